@@ -0,0 +1,68 @@
+// aPpLegUo
+// Call-path benchmark: calls/sec and heap allocations per call for small script functions.
+// Usage: call_bench [calls]
+#include "potatolang.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+
+static std::atomic<long> g_allocations{0};
+
+void* operator new(std::size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+// The shape of the bootstrap parser's hot path: tiny accessors called once per token.
+static const char* kCallScript = R"POTATO(
+fun tok_type(tok) { return get(tok, 0); }
+fun is_type(tok, t) { return tok_type(tok) == t; }
+let tok = list();
+push(tok, "Identifier");
+push(tok, "x");
+let i = 0;
+let hits = 0;
+while (i < calls) {
+  if (is_type(tok, "Identifier")) { hits = hits + 1; }
+  i = i + 1;
+}
+)POTATO";
+
+int main(int argc, char** argv) {
+  long calls = argc > 1 ? std::atol(argv[1]) : 1000000;
+
+  std::ostringstream compile_err;
+  auto program = potatolang::CompiledProgram::Compile(kCallScript, compile_err);
+  if (!program) {
+    std::cerr << compile_err.str();
+    return 1;
+  }
+  std::ostringstream out, err;
+  potatolang::Interpreter interp(out, err, "");
+  interp.DefineGlobal("calls", potatolang::Value::Number(static_cast<double>(calls)));
+
+  long before = g_allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  int rc = interp.Run(program);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  long allocations = g_allocations.load() - before;
+  if (rc != 0) {
+    std::cerr << err.str();
+    return 1;
+  }
+
+  // Each iteration makes two script calls (is_type, tok_type) and one native call (get).
+  double script_calls = 2.0 * static_cast<double>(calls);
+  std::cout << "iterations: " << calls << "\n";
+  std::cout << "script calls/s: " << static_cast<long>(script_calls / seconds) << "\n";
+  std::cout << "heap allocations per iteration: " << static_cast<double>(allocations) / static_cast<double>(calls)
+            << "\n";
+  return 0;
+}
@@ -0,0 +1,70 @@
+// aPpLegUo
+// Throughput benchmark: RunScript per request vs. a shared CompiledProgram + InterpreterPool.
+// Usage: pool_bench [requests] [threads]
+#include "potatolang.h"
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A small rule script in the shape of a typical embedded use: parse the request, apply
+// a few rules, and write a verdict.
+static const char* kRuleScript = R"POTATO(
+fun score(line) {
+  let s = 0;
+  let pos = 0;
+  while (pos < len(line)) {
+    let end = scan_until(line, pos, " ");
+    if (end - pos > 8) { s = s + 1; }
+    pos = end + 1;
+  }
+  return s;
+}
+if (score(input) > 2) { write("accept"); } else { write("reject"); }
+)POTATO";
+
+static const char* kRequest = "user=42 action=login region=eu-west agent=cli";
+
+template <typename F>
+static double RequestsPerSecond(int requests, int threads, F run_one) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads; t++) {
+    pool.emplace_back([&, t]() {
+      for (int i = t; i < requests; i += threads) run_one();
+    });
+  }
+  for (auto& th : pool) th.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return requests / seconds;
+}
+
+int main(int argc, char** argv) {
+  int requests = argc > 1 ? std::atoi(argv[1]) : 20000;
+  int threads = argc > 2 ? std::atoi(argv[2]) : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+  double fresh = RequestsPerSecond(requests, threads, []() {
+    std::ostringstream out, err;
+    potatolang::RunScript(kRuleScript, kRequest, out, err);
+  });
+
+  std::ostringstream compile_err;
+  auto program = potatolang::CompiledProgram::Compile(kRuleScript, compile_err);
+  if (!program) {
+    std::cerr << compile_err.str();
+    return 1;
+  }
+  potatolang::InterpreterPool interpreters(program);
+  double pooled = RequestsPerSecond(requests, threads, [&]() {
+    std::ostringstream out, err;
+    interpreters.Run(kRequest, out, err);
+  });
+
+  std::cout << "requests: " << requests << ", threads: " << threads << "\n";
+  std::cout << "RunScript:       " << static_cast<long>(fresh) << " req/s (" << 1e6 / fresh * threads << " us/req)\n";
+  std::cout << "InterpreterPool: " << static_cast<long>(pooled) << " req/s (" << 1e6 / pooled * threads
+            << " us/req, " << interpreters.size() << " interpreters)\n";
+  return 0;
+}
@@ -1,9 +1,18 @@
 // aPpLegUo
 #include "potatolang.h"
 #include <iostream>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <string>
+#include <thread>
 #include <vector>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 // Helper to replace all occurrences of a substring
 static void ReplaceAll(std::string& str, const std::string& from, const std::string& to) {
@@ -15,71 +24,409 @@ static void ReplaceAll(std::string& str, const std::string& from, const std::str
     }
 }
 
+// Source of the program --out compiles: script embedded as a raw string plus a main().
+static std::string StubSource(const std::string& script) {
+  std::string src = "// aPpLegUo\n";
+#ifdef POTATOLANG_RT_LIB
+  // Only a stub: the interpreter comes from the prebuilt runtime library.
+  src += "#include \"potato_rt.h\"\n";
+  src += "static const char kEmbeddedScript[] = R\"POTATO_EMBED(\n" + script + "\n)POTATO_EMBED\";\n";
+  src += "int main(int argc, char** argv) {\n";
+  src += "  return potatolang::RunEmbeddedScript(kEmbeddedScript, sizeof(kEmbeddedScript) - 1, argc, argv);\n";
+  src += "}\n";
+#else
+  src += "#include \"potatolang.h\"\n";
+  src += "const char* kEmbeddedScript = R\"POTATO_EMBED(\n" + script + "\n)POTATO_EMBED\";\n";
+  src += "int main(int argc, char** argv) {\n";
+  src += "  try {\n";
+  src += "    potatolang::InterpreterOptions options;\n";
+  src += "    std::string inputPath;\n";
+  src += "    for (int i = 1; i < argc; i++) {\n";
+  src += "      std::string arg = argv[i];\n";
+  src += "      if (arg == \"--unbuffered\") options.unbuffered = true;\n";
+  src += "      else if (inputPath.empty()) inputPath = arg;\n";
+  src += "    }\n";
+  src += "    if (!options.unbuffered) potatolang::ConfigureStdout();\n";
+  src += "    auto input = !inputPath.empty() ? potatolang::InputSource::Open(inputPath) : potatolang::InputSource::FromString(\"\");\n";
+  src += "    return potatolang::RunScript(kEmbeddedScript, input, std::cout, std::cerr, options);\n";
+  src += "  } catch (const std::exception& e) {\n";
+  src += "    std::cerr << e.what() << \"\\n\";\n";
+  src += "    return 1;\n";
+  src += "  }\n";
+  src += "}\n";
+#endif
+  return src;
+}
+
+#ifndef _WIN32
+static std::string ShellQuote(const std::string& s) {
+  std::string out = "'";
+  for (char c : s) {
+    if (c == '\'') out += "'\\''";
+    else out += c;
+  }
+  return out + "'";
+}
+
+static int RunCommand(const std::string& cmd) {
+  int status = std::system(cmd.c_str());
+  if (status == -1 || !WIFEXITED(status)) return 1;
+  return WEXITSTATUS(status);
+}
+
+// Creates an empty file with a unique name from pattern, which ends in XXXXXX followed by
+// suffixLength more characters, and returns its path.
+static std::string MakeTempFile(std::string pattern, int suffixLength) {
+  int fd = mkstemps(&pattern[0], suffixLength);
+  if (fd < 0) throw std::runtime_error("Failed to create a temporary file: " + pattern);
+  ::close(fd);
+  return pattern;
+}
+
+// SHA-256 over the cache key inputs, so unrelated builds cannot share an entry. Each field
+// is prefixed with its length so adjacent fields cannot run together.
+class BuildHash {
+ public:
+  void Add(const std::string& field) {
+    std::uint64_t n = field.size();
+    Update(reinterpret_cast<const unsigned char*>(&n), sizeof(n));
+    Update(reinterpret_cast<const unsigned char*>(field.data()), field.size());
+  }
+
+  // Finishes the digest; the hash must not be added to afterwards.
+  std::string Hex() {
+    std::uint64_t bits = length_ * 8;
+    unsigned char pad = 0x80;
+    Update(&pad, 1);
+    pad = 0;
+    while (used_ != 56) Update(&pad, 1);
+    unsigned char len[8];
+    for (int i = 0; i < 8; i++) len[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+    Update(len, 8);
+    char buf[65];
+    for (int i = 0; i < 8; i++) std::snprintf(buf + 8 * i, 9, "%08x", static_cast<unsigned>(h_[i]));
+    return buf;
+  }
+
+ private:
+  static std::uint32_t Rotr(std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+  void Update(const unsigned char* p, std::size_t n) {
+    length_ += n;
+    for (std::size_t i = 0; i < n; i++) {
+      block_[used_++] = p[i];
+      if (used_ == 64) {
+        Compress();
+        used_ = 0;
+      }
+    }
+  }
+
+  void Compress() {
+    static const std::uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    std::uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = static_cast<std::uint32_t>(block_[4 * i]) << 24 | static_cast<std::uint32_t>(block_[4 * i + 1]) << 16 |
+             static_cast<std::uint32_t>(block_[4 * i + 2]) << 8 | block_[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+      std::uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      std::uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    std::uint32_t a = h_[0], b = h_[1], c = h_[2], d = h_[3], e = h_[4], f = h_[5], g = h_[6], h = h_[7];
+    for (int i = 0; i < 64; i++) {
+      std::uint32_t t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+      std::uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    h_[0] += a;
+    h_[1] += b;
+    h_[2] += c;
+    h_[3] += d;
+    h_[4] += e;
+    h_[5] += f;
+    h_[6] += g;
+    h_[7] += h;
+  }
+
+  std::uint32_t h_[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  unsigned char block_[64];
+  std::size_t used_ = 0;
+  std::uint64_t length_ = 0;
+};
+
+// Where --out keeps finished binaries: $POTATOLANG_CACHE_DIR, else $XDG_CACHE_HOME/potatolang,
+// else ~/.cache/potatolang. Empty if none of these is set.
+static std::string OutCacheDirectory() {
+  if (const char* dir = std::getenv("POTATOLANG_CACHE_DIR")) return dir;
+  if (const char* xdg = std::getenv("XDG_CACHE_HOME")) return std::string(xdg) + "/potatolang";
+  if (const char* home = std::getenv("HOME")) return std::string(home) + "/.cache/potatolang";
+  return "";
+}
+
+#ifdef POTATOLANG_RT_LIB
+// The runtime library and headers --out builds against are referenced by their absolute
+// paths in the CMake build tree, so --out works only while that tree is still in place.
+static void RequireBuildTree(const std::vector<std::string>& files) {
+  std::error_code ec;
+  for (const auto& file : files) {
+    if (!std::filesystem::exists(file, ec)) {
+      throw std::runtime_error("--out needs the build tree potatolang was built in, but " + file +
+                               " is missing; rebuild potatolang with CMake");
+    }
+  }
+}
+#endif
+
+// Compiles script into a standalone binary at outputPath. Finished binaries are cached under
+// a hash of the stub source (which embeds the script), its imports, the runtime the stub is
+// built against and the compile command, so rebuilding an unchanged script is a file copy.
+static int BuildBinary(const std::string& script, const std::string& outputPath) {
+  const std::string source = StubSource(script);
+#ifdef POTATOLANG_RT_LIB
+  // Compile the stub and link it against the runtime library built with this binary.
+  const std::string compiler = POTATOLANG_CXX;
+  const std::string flags = " -std=c++17 -O2 -I" POTATOLANG_RT_INCLUDE_DIR;
+  const std::string libs = " " POTATOLANG_RT_LIB " $(pkg-config --libs sdl2) -lpthread";
+  const std::vector<std::string> runtimeFiles = {POTATOLANG_RT_LIB, POTATOLANG_RT_INCLUDE_DIR "/potato_rt.h"};
+  RequireBuildTree(runtimeFiles);
+#else
+  // Include current directory for potatolang.h
+  const std::string compiler = "clang++";
+  const std::string flags = " -std=c++17 -O2 -I.";
+  const std::string libs = " $(pkg-config --cflags --libs sdl2)";
+  const std::vector<std::string> runtimeFiles = {"potatolang.h"};
+#endif
+
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  std::string cached;
+  std::string cacheDir = OutCacheDirectory();
+  if (!cacheDir.empty()) fs::create_directories(cacheDir, ec);
+  if (!cacheDir.empty() && !ec) {
+    BuildHash hash;
+    hash.Add("potatolang --out cache v2");
+    hash.Add(compiler + flags + libs);
+    for (const auto& path : runtimeFiles) {
+      std::string contents;
+      hash.Add(potatolang::ReadWholeFile(path, contents) ? contents : "<missing>");
+    }
+    // Imported modules are not part of the key: the binary reads them when it runs, and
+    // the built-in ones are compiled into the runtime hashed above.
+    hash.Add(source);
+    cached = cacheDir + "/" + hash.Hex();
+    if (fs::is_regular_file(cached, ec)) {
+      // Remove first: the output may be a running binary, which cannot be overwritten in place.
+      fs::remove(outputPath, ec);
+      if (fs::copy_file(cached, outputPath, ec)) return 0;
+    }
+  }
+
+  std::string tempFile = MakeTempFile((fs::temp_directory_path() / "potato_out_XXXXXX.cpp").string(), 4);
+  {
+    std::ofstream out(tempFile);
+    out << source;
+  }
+  // Build into a uniquely named file next to the cache entry and rename it into place, so
+  // concurrent builds of the same script never see a half-written binary. If the cache
+  // directory turns out not to be writable, build straight to the output uncached.
+  std::string target = outputPath;
+  if (!cached.empty()) {
+    try {
+      target = MakeTempFile(cached + ".XXXXXX", 0);
+    } catch (const std::runtime_error&) {
+      cached.clear();
+    }
+  }
+  int ret = RunCommand(compiler + flags + " -o " + ShellQuote(target) + " " + tempFile + libs);
+  fs::remove(tempFile, ec);
+  if (cached.empty()) return ret;
+  if (ret != 0) {
+    fs::remove(target, ec);
+    return ret;
+  }
+  fs::rename(target, cached, ec);
+  if (ec) throw std::runtime_error("Failed to store " + target + " in the build cache: " + ec.message());
+  fs::remove(outputPath, ec);
+  fs::copy_file(cached, outputPath, ec);
+  if (ec) throw std::runtime_error("Failed to write " + outputPath + ": " + ec.message());
+  return 0;
+}
+#endif
+
+#ifdef POTATOLANG_RT_LIB
+#ifndef _WIN32
+// --out with --pgo-train: builds the stub and the runtime from source with profiling
+// instrumentation, runs the binary once per training input, then rebuilds both at -O3
+// with the collected profile. Both builds use the same flags and object paths because GCC
+// keys its profile files by object path and rejects profiles whose control flow differs.
+static int BuildWithPgo(const std::string& script, const std::string& outputPath,
+                        const std::vector<std::string>& trainInputs) {
+#if defined(POTATOLANG_CXX_IS_CLANG) && !defined(POTATOLANG_LLVM_PROFDATA)
+  throw std::runtime_error("--pgo-train with Clang needs llvm-profdata; install it and re-run CMake");
+#endif
+  RequireBuildTree({POTATOLANG_RT_INCLUDE_DIR "/potato_rt.cpp", POTATOLANG_SOURCE_DIR "/potatolang.h",
+                    POTATOLANG_GENERATED_DIR "/potatos_embedded.inc"});
+  char dirTemplate[] = "/tmp/potato_pgo_XXXXXX";
+  if (!mkdtemp(dirTemplate)) throw std::runtime_error("Failed to create a temporary directory");
+  const std::string dir = dirTemplate;
+  const std::string profile = dir + "/profile";
+  {
+    std::ofstream out(dir + "/stub.cpp");
+    out << StubSource(script);
+  }
+
+  const std::string cxx = POTATOLANG_CXX;
+  const std::string includes = " -I" POTATOLANG_RT_INCLUDE_DIR " -I" POTATOLANG_SOURCE_DIR " -I" POTATOLANG_GENERATED_DIR
+                               " $(pkg-config --cflags sdl2)";
+  const std::string objects = " " + dir + "/stub.o " + dir + "/rt.o";
+  auto build = [&](const std::string& flags, const std::string& output) {
+    for (const auto& unit : {std::make_pair(dir + "/stub.cpp", dir + "/stub.o"),
+                             std::make_pair(std::string(POTATOLANG_RT_INCLUDE_DIR "/potato_rt.cpp"), dir + "/rt.o")}) {
+      int rc = RunCommand(cxx + " -std=c++17 " + flags + includes + " -c " + unit.first + " -o " + unit.second);
+      if (rc != 0) return rc;
+    }
+    return RunCommand(cxx + " " + flags + " -o " + ShellQuote(output) + objects + " $(pkg-config --libs sdl2) -lpthread");
+  };
+
+  int rc = 0;
+  std::cerr << "pgo: building instrumented binary\n";
+  rc = build("-O3 -fprofile-generate=" + profile, dir + "/train");
+  for (std::size_t i = 0; rc == 0 && i < trainInputs.size(); i++) {
+    std::cerr << "pgo: training on " << trainInputs[i] << "\n";
+    int exit = RunCommand(dir + "/train " + ShellQuote(trainInputs[i]) + " > /dev/null");
+    if (exit != 0) std::cerr << "pgo: warning: training run exited with " << exit << "\n";
+  }
+#ifdef POTATOLANG_LLVM_PROFDATA
+  // Clang writes one raw profile per run; they have to be merged before use.
+  if (rc == 0) rc = RunCommand(std::string(POTATOLANG_LLVM_PROFDATA) + " merge -output=" + dir + "/merged.profdata " + profile);
+  std::string useFlag = "-fprofile-use=" + dir + "/merged.profdata";
+#else
+  // GCC accumulates counters across runs in place. Code the training never reached is
+  // still optimized normally rather than for size.
+  std::string useFlag = "-fprofile-use=" + profile + " -fprofile-partial-training";
+#endif
+  if (rc == 0) {
+    std::cerr << "pgo: building optimized binary\n";
+    rc = build("-O3 " + useFlag, outputPath);
+  }
+  RunCommand("rm -rf " + dir);
+  return rc;
+}
+#endif
+#endif
+
 int main(int argc, char** argv) {
   try {
 
-    // Compilation mode: ./potatolang <script> --out <binary>
+    // Compilation mode: ./potatolang <script> --out <binary> [--pgo-train <input>...]
     if (argc >= 4 && std::string(argv[2]) == "--out") {
       std::string sourcePath = argv[1];
       std::string outputPath = argv[3];
       std::string script = potatolang::ReadFile(sourcePath);
-      
-      // Generate a safe temporary filename
-      std::string safeName = outputPath;
-      for (char& c : safeName) {
-          if (c == '/' || c == '\\' || c == '.') c = '_';
+      if (argc >= 5 && std::string(argv[4]) == "--pgo-train") {
+        std::vector<std::string> trainInputs(argv + 5, argv + argc);
+        if (trainInputs.empty()) throw std::runtime_error("Usage: potatolang <script.pt> --out <binary> --pgo-train <input>...");
+#if defined(POTATOLANG_RT_LIB) && !defined(_WIN32)
+        return BuildWithPgo(script, outputPath, trainInputs);
+#else
+        throw std::runtime_error("--pgo-train needs potatolang built with CMake");
+#endif
       }
-      std::string tempFile = "temp_build_" + safeName + ".cpp";
-      
-      // Write to a temporary file
-      {
-          std::ofstream out(tempFile);
-          out << "// aPpLegUo\n";
-          out << "#include \"potatolang.h\"\n"; 
-          out << "const char* kEmbeddedScript = R\"POTATO_EMBED(\n" << script << "\n)POTATO_EMBED\";\n";
-          out << "int main(int argc, char** argv) {\n";
-          out << "  try {\n";
-          out << "    std::string input;\n";
-          out << "    if (argc >= 2) {\n";
-          out << "      if (std::string(argv[1]) == \"-\") {\n";
-          out << "        input = potatolang::ReadAll(std::cin);\n";
-          out << "      } else {\n";
-          out << "        input = potatolang::ReadFile(argv[1]);\n";
-          out << "      }\n";
-          out << "    }\n";
-          out << "    return potatolang::RunScript(kEmbeddedScript, input, std::cout, std::cerr);\n";
-          out << "  } catch (const std::exception& e) {\n";
-          out << "    std::cerr << e.what() << \"\\n\";\n";
-          out << "    return 1;\n";
-          out << "  }\n";
-          out << "}\n";
+
+#ifndef _WIN32
+      return BuildBinary(script, outputPath);
+#else
+      throw std::runtime_error("--out is not supported on Windows");
+#endif
+    }
+
+#ifndef _WIN32
+    // Server mode: ./potatolang --serve <socket> [--max-steps N] [--time-limit-ms N]
+    if (argc >= 2 && std::string(argv[1]) == "--serve") {
+      if (argc < 3) throw std::runtime_error("Usage: potatolang --serve <socket> [--max-steps N] [--time-limit-ms N]");
+      potatolang::InterpreterOptions options;
+      for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+        if (arg == "--max-steps") options.max_steps = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--time-limit-ms") options.time_limit = std::chrono::milliseconds(std::atol(argv[++i]));
+        else throw std::runtime_error("Unknown --serve option: " + arg);
       }
-      
-      // Compile the temporary file
-      // Include current directory for potatolang.h
-      std::string cmd = "clang++ -std=c++17 -o " + outputPath + " " + tempFile + " -I. $(pkg-config --cflags --libs sdl2)";
-      int ret = std::system(cmd.c_str());
-      
-      // Clean up
-      std::system(("rm " + tempFile).c_str());
-      
-      return ret;
+      return potatolang::Serve(argv[2], options, std::cerr);
+    }
+
+    // Client mode: ./potatolang --client <socket> <script.pt> [input]
+    if (argc >= 2 && std::string(argv[1]) == "--client") {
+      if (argc < 4) throw std::runtime_error("Usage: potatolang --client <socket> <script.pt> [input]");
+      return potatolang::RunClient(argv[2], argv[3], argc >= 5 ? argv[4] : "", std::cerr);
+    }
+#endif
+
+    // Snapshot mode: ./potatolang --make-snapshot <out.snap> [module...]
+    if (argc >= 2 && std::string(argv[1]) == "--make-snapshot") {
+      if (argc < 3) throw std::runtime_error("Usage: potatolang --make-snapshot <out.snap> [module...]");
+      std::vector<std::string> modules(argv + 3, argv + argc);
+      if (modules.empty()) modules = potatolang::DefaultSnapshotModules();
+      return potatolang::MakeSnapshot(modules, argv[2], std::cerr);
+    }
+
+    // Type dump mode: ./potatolang --dump-types <script.pt>
+    if (argc >= 2 && std::string(argv[1]) == "--dump-types") {
+      if (argc < 3) throw std::runtime_error("Usage: potatolang --dump-types <script.pt>");
+      return potatolang::DumpTypes(potatolang::ReadFile(argv[2]), std::cout, std::cerr);
     }
 
     if (argc >= 2 && std::string(argv[1]) == "--run") {
-      if (argc < 3) throw std::runtime_error("Usage: potatolang --run <script.pt> [input.pt]");
-      std::string script = potatolang::ReadFile(argv[2]);
-      std::string input;
-      if (argc >= 4) {
-        if (std::string(argv[3]) == "-") {
-          input = potatolang::ReadAll(std::cin);
-        } else {
-          input = potatolang::ReadFile(argv[3]);
+      const char* usage =
+          "Usage: potatolang --run <script.pt> [input.pt] [--unbuffered] [--max-steps N] [--time-limit-ms N]\n"
+          "                                   [--snapshot=<file.snap>] [--module-path dir]...\n"
+          "       potatolang --run <script.pt> --batch <list.txt|dir/> [--jobs N] [--out-dir dir/]";
+      if (argc < 3) throw std::runtime_error(usage);
+      potatolang::InterpreterOptions options;
+      std::string inputPath, batchSpec, outDir;
+      unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+      for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--unbuffered") options.unbuffered = true;
+        else if ((arg == "--batch" || arg == "--jobs" || arg == "--out-dir" || arg == "--max-steps" ||
+                  arg == "--time-limit-ms" || arg == "--module-path") && i + 1 >= argc) throw std::runtime_error(usage);
+        else if (arg == "--batch") batchSpec = argv[++i];
+        else if (arg == "--jobs") jobs = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        else if (arg == "--out-dir") outDir = argv[++i];
+        else if (arg == "--max-steps") options.max_steps = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--time-limit-ms") options.time_limit = std::chrono::milliseconds(std::atol(argv[++i]));
+        else if (arg == "--module-path") options.module_path.push_back(argv[++i]);
+        else if (arg.rfind("--snapshot=", 0) == 0) {
+          options.snapshot = potatolang::Snapshot::Load(arg.substr(11), std::cerr);
+          if (!options.snapshot) return 1;
         }
-      } else {
-        input = "";
+        else if (inputPath.empty()) inputPath = arg;
+      }
+      if (!options.unbuffered) potatolang::ConfigureStdout();
+      std::string script = potatolang::ReadFile(argv[2]);
+      if (!batchSpec.empty()) {
+        return potatolang::RunBatch(script, potatolang::ListBatchInputs(batchSpec), jobs, outDir, std::cout, std::cerr,
+                                    options);
       }
-      return potatolang::RunScript(script, input, std::cout, std::cerr);
+      auto input = !inputPath.empty() ? potatolang::InputSource::Open(inputPath) : potatolang::InputSource::FromString("");
+      return potatolang::RunScript(script, input, std::cout, std::cerr, options);
     }
     if (argc >= 2) return potatolang::ParseOnly(potatolang::ReadFile(argv[1]), std::cout, std::cerr);
     return potatolang::ParseOnly(potatolang::ReadAll(std::cin), std::cout, std::cerr);
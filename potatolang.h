@@ -1,8 +1,17 @@
 #pragma once
 // aPpLegUo
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
 #include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <functional>
 #include <fstream>
 #include <iomanip>
@@ -10,6 +19,7 @@
 #include <memory>
 #include <optional>
 #include <random>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -19,6 +29,9 @@
 #include <variant>
 #include <vector>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 
 #define SDL_MAIN_HANDLED
 #include <SDL2/SDL.h>
@@ -124,14 +137,20 @@ static const unsigned char kFont5x7[] = {
     0x7F, 0x7F, 0x7F, 0x7F, 0x7F, // (DEL/Block)
 };
 
-// Global SDL variables
-static SDL_Window* g_window = nullptr;
-static SDL_Renderer* g_renderer = nullptr;
-
 #ifndef _WIN32
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+extern char** environ;
 #endif
 
 namespace potatolang {
@@ -169,6 +188,7 @@ enum class TokenType {
   While,
   Fun,
   Return,
+  Yield,
   Import,
   True,
   False,
@@ -221,6 +241,7 @@ static std::string TokenTypeName(TokenType t) {
     case TokenType::While: return "While";
     case TokenType::Fun: return "Fun";
     case TokenType::Return: return "Return";
+    case TokenType::Yield: return "Yield";
     case TokenType::Import: return "Import";
     case TokenType::True: return "True";
     case TokenType::False: return "False";
@@ -328,6 +349,7 @@ class Lexer {
     if (s == "while") return Make(TokenType::While, s, start);
     if (s == "fun") return Make(TokenType::Fun, s, start);
     if (s == "return") return Make(TokenType::Return, s, start);
+    if (s == "yield") return Make(TokenType::Yield, s, start);
     if (s == "import") return Make(TokenType::Import, s, start);
     if (s == "true") return Make(TokenType::True, s, start);
     if (s == "false") return Make(TokenType::False, s, start);
@@ -429,8 +451,12 @@ struct LiteralExpr : Expr {
   enum class Kind { Number, String, Bool, Nil };
   Kind kind;
   std::string value;
+  // value parsed once, for number literals.
+  double number = 0;
 
-  LiteralExpr(Kind k, std::string v) : kind(k), value(std::move(v)) {}
+  LiteralExpr(Kind k, std::string v) : kind(k), value(std::move(v)) {
+    if (kind == Kind::Number) number = std::strtod(value.c_str(), nullptr);
+  }
 
   void Print(std::ostream& out) const override {
     switch (kind) {
@@ -476,6 +502,8 @@ struct GroupingExpr : Expr {
 struct UnaryExpr : Expr {
   Token op;
   ExprPtr right;
+  // Set by InferTypes when the operand is always a number.
+  bool numeric = false;
   UnaryExpr(Token o, ExprPtr r) : op(std::move(o)), right(std::move(r)) {}
   void Print(std::ostream& out) const override {
     out << "(" << op.lexeme << " ";
@@ -488,6 +516,8 @@ struct BinaryExpr : Expr {
   ExprPtr left;
   Token op;
   ExprPtr right;
+  // Set by InferTypes when both operands are always numbers.
+  bool numeric = false;
   BinaryExpr(ExprPtr l, Token o, ExprPtr r) : left(std::move(l)), op(std::move(o)), right(std::move(r)) {}
   void Print(std::ostream& out) const override {
     out << "(" << op.lexeme << " ";
@@ -633,6 +663,8 @@ struct FunctionStmt : Stmt {
   Token name;
   std::vector<Token> params;
   std::vector<StmtPtr> body;
+  // Set by the parser when the body contains `yield`; calling it then returns a generator.
+  bool is_generator = false;
   FunctionStmt(Token n, std::vector<Token> p, std::vector<StmtPtr> b)
       : name(std::move(n)), params(std::move(p)), body(std::move(b)) {}
   void Print(std::ostream& out) const override {
@@ -661,6 +693,20 @@ struct ReturnStmt : Stmt {
   }
 };
 
+struct YieldStmt : Stmt {
+  Token keyword;
+  std::optional<ExprPtr> value;
+  YieldStmt(Token k, std::optional<ExprPtr> v) : keyword(std::move(k)), value(std::move(v)) {}
+  void Print(std::ostream& out) const override {
+    out << "(yield";
+    if (value.has_value()) {
+      out << " ";
+      (*value)->Print(out);
+    }
+    out << ")";
+  }
+};
+
 class Parser {
  public:
   explicit Parser(std::vector<Token> tokens) : tokens_(std::move(tokens)) {}
@@ -710,6 +756,7 @@ class Parser {
     if (Match(TokenType::If)) return ParseIfStmt();
     if (Match(TokenType::While)) return ParseWhileStmt();
     if (Match(TokenType::Return)) return ParseReturnStmt();
+    if (Match(TokenType::Yield)) return ParseYieldStmt();
     if (Check(TokenType::Identifier) && CheckNext(TokenType::Equal)) return ParseAssignStmt();
     if (Match(TokenType::Print)) return ParsePrintStmt();
     return ParseExprStmt();
@@ -772,12 +819,28 @@ class Parser {
     }
     Consume(TokenType::RightParen, "Expected ')' after parameters");
     Consume(TokenType::LeftBrace, "Expected '{' before function body");
+    bool* outer_yield = yield_seen_;
+    bool has_yield = false;
+    yield_seen_ = &has_yield;
     std::vector<StmtPtr> body;
     while (!Check(TokenType::RightBrace) && !Check(TokenType::Eof)) {
       body.push_back(ParseDeclaration());
     }
+    yield_seen_ = outer_yield;
     Consume(TokenType::RightBrace, "Expected '}' after function body");
-    return std::make_unique<FunctionStmt>(std::move(name), std::move(params), std::move(body));
+    auto fn = std::make_unique<FunctionStmt>(std::move(name), std::move(params), std::move(body));
+    fn->is_generator = has_yield;
+    return fn;
+  }
+
+  StmtPtr ParseYieldStmt() {
+    Token keyword = Previous();
+    if (!yield_seen_) throw Error(keyword, "'yield' outside of a function");
+    *yield_seen_ = true;
+    if (Match(TokenType::Semicolon)) return std::make_unique<YieldStmt>(std::move(keyword), std::nullopt);
+    ExprPtr value = ParseExpr();
+    Consume(TokenType::Semicolon, "Expected ';' after yield value");
+    return std::make_unique<YieldStmt>(std::move(keyword), std::optional<ExprPtr>(std::move(value)));
   }
 
   StmtPtr ParseReturnStmt() {
@@ -933,6 +996,8 @@ class Parser {
 
   std::vector<Token> tokens_;
   std::size_t current_ = 0;
+  // Points at the innermost enclosing function's "contains yield" flag, or null at top level.
+  bool* yield_seen_ = nullptr;
 };
 
 struct RuntimeError : public std::runtime_error {
@@ -943,15 +1008,34 @@ struct Value;
 struct ListValue;
 struct FunctionValue;
 struct NativeFunctionValue;
+class ArgList;
+
+// Identifies the par_map/par_reduce worker running on this thread, or 0 outside one. Every
+// worker of every parallel call gets a fresh token. Scopes, lists and natives remember the
+// token they were created under, and a worker may only modify (or call) its own.
+static std::uint64_t& ParallelToken() {
+  static thread_local std::uint64_t token = 0;
+  return token;
+}
 
 struct ListValue {
   std::vector<Value> items;
+  // Set for JSON objects, which are stored as a list of [key, value] pairs.
+  bool is_object = false;
+  std::uint64_t owner = ParallelToken();
 };
 
 struct NativeFunctionValue {
   std::string name;
   int arity = -1;
-  std::function<Value(const std::vector<Value>&)> fn;
+  // Builtins hold no script state of their own and may be called from parallel workers.
+  bool builtin = false;
+  std::uint64_t owner = ParallelToken();
+  std::function<Value(ArgList)> fn;
+  // Natives registered with Interpreter::Register are called through invoke(target, args)
+  // instead of fn; args points at exactly `arity` values.
+  Value (*invoke)(void (*target)(), const Value* args) = nullptr;
+  void (*target)() = nullptr;
 };
 
 struct FunctionValue {
@@ -978,6 +1062,26 @@ struct Value {
   Value() : v(std::monostate{}) {}
 };
 
+// A read-only view of the arguments of a call. Arguments live in the interpreter's value
+// stack (or in the caller's own storage), so passing them to a native does not allocate.
+class ArgList {
+ public:
+  ArgList() = default;
+  ArgList(const Value* data, std::size_t size) : data_(data), size_(size) {}
+  ArgList(const std::vector<Value>& values) : data_(values.data()), size_(values.size()) {}
+
+  const Value& operator[](std::size_t i) const { return data_[i]; }
+  const Value* data() const { return data_; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const Value* begin() const { return data_; }
+  const Value* end() const { return data_ + size_; }
+
+ private:
+  const Value* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
 static bool IsNil(const Value& v) { return std::holds_alternative<std::monostate>(v.v); }
 static bool IsNumber(const Value& v) { return std::holds_alternative<double>(v.v); }
 static bool IsBool(const Value& v) { return std::holds_alternative<bool>(v.v); }
@@ -991,6 +1095,15 @@ static double AsNumber(const Value& v) {
   return std::get<double>(v.v);
 }
 
+// A byte count passed to a read function: negative counts are 0, and NaN, infinities and
+// counts beyond 2^53 (which no file or pipe will satisfy) are errors rather than an
+// out-of-range conversion.
+static std::size_t AsByteCount(const Value& v) {
+  double n = AsNumber(v);
+  if (!(n < 9007199254740992.0)) throw RuntimeError("Byte count out of range");
+  return n > 0 ? static_cast<std::size_t>(n) : 0;
+}
+
 static bool AsBool(const Value& v) {
   if (!IsBool(v)) throw RuntimeError("Expected bool");
   return std::get<bool>(v.v);
@@ -1006,12 +1119,86 @@ static std::shared_ptr<ListValue> AsList(const Value& v) {
   return std::get<std::shared_ptr<ListValue>>(v.v);
 }
 
+// AsList for builtins that modify the list. Parallel workers may only modify lists they
+// created themselves.
+static std::shared_ptr<ListValue> AsMutableList(const Value& v) {
+  std::shared_ptr<ListValue> l = AsList(v);
+  if (ParallelToken() != 0 && l->owner != ParallelToken()) {
+    throw RuntimeError("Cannot modify shared list inside a parallel worker");
+  }
+  return l;
+}
+
+// Maps the C++ parameter and return types allowed in Interpreter::Register signatures to
+// Potatolang values: Value itself, bool, arithmetic types (numbers), std::string (passed
+// by const reference without a copy), const char* (return only), and lists.
+template <typename T, typename Enable = void>
+struct NativeType;
+
+template <>
+struct NativeType<Value> {
+  static const Value& From(const Value& v) { return v; }
+  static Value To(Value v) { return v; }
+};
+
+template <>
+struct NativeType<bool> {
+  static bool From(const Value& v) { return AsBool(v); }
+  static Value To(bool b) { return Value::Bool(b); }
+};
+
+template <typename T>
+struct NativeType<T, std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>> {
+  static T From(const Value& v) { return static_cast<T>(AsNumber(v)); }
+  static Value To(T x) { return Value::Number(static_cast<double>(x)); }
+};
+
+template <>
+struct NativeType<std::string> {
+  static const std::string& From(const Value& v) { return AsString(v); }
+  static Value To(std::string s) { return Value::Str(std::move(s)); }
+};
+
+template <>
+struct NativeType<const char*> {
+  static Value To(const char* s) { return Value::Str(s); }
+};
+
+template <>
+struct NativeType<std::shared_ptr<ListValue>> {
+  static std::shared_ptr<ListValue> From(const Value& v) { return AsList(v); }
+  static Value To(std::shared_ptr<ListValue> l) { return Value::List(std::move(l)); }
+};
+
+// Unpacks arguments for a typed native and calls it through the original function pointer.
+template <typename R, typename... Args>
+struct NativeThunk {
+  static Value Invoke(void (*target)(), const Value* args) {
+    return Call(reinterpret_cast<R (*)(Args...)>(target), args, std::index_sequence_for<Args...>{});
+  }
+
+  template <std::size_t... I>
+  static Value Call(R (*fn)(Args...), const Value* args, std::index_sequence<I...>) {
+    (void)args;
+    if constexpr (std::is_void_v<R>) {
+      fn(NativeType<std::decay_t<Args>>::From(args[I])...);
+      return Value::Nil();
+    } else {
+      return NativeType<std::decay_t<R>>::To(fn(NativeType<std::decay_t<Args>>::From(args[I])...));
+    }
+  }
+};
+
 static std::string NumberToString(double x) {
   if (std::isnan(x)) return "nan";
   if (std::isinf(x)) return (x < 0) ? "-inf" : "inf";
-  std::ostringstream oss;
-  oss << std::setprecision(15) << x;
-  std::string s = oss.str();
+  if (x == std::trunc(x) && std::fabs(x) < 1e15 && !(x == 0 && std::signbit(x))) {
+    return std::to_string(static_cast<long long>(x));
+  }
+  // Same formatting as an ostream with setprecision(15), without the stream.
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%.15g", x);
+  std::string s = buf;
   if (s.find('.') != std::string::npos) {
     while (!s.empty() && s.back() == '0') s.pop_back();
     if (!s.empty() && s.back() == '.') s.pop_back();
@@ -1053,275 +1240,3479 @@ static std::string ValueToString(const Value& v) {
   return "nil";
 }
 
-struct Environment : std::enable_shared_from_this<Environment> {
-  std::unordered_map<std::string, Value> values;
-  std::shared_ptr<Environment> parent;
-
-  explicit Environment(std::shared_ptr<Environment> p = nullptr) : parent(std::move(p)) {}
+// Tags of the binary value format used by serialize/deserialize.
+enum class SerialTag : unsigned char { Nil, False, True, Int, Number, String, List, ListRef, Object };
 
-  void Define(const std::string& name, Value v) { values[name] = std::move(v); }
+static constexpr char kSerialMagic[] = "PTV1";
 
-  Value Get(const Token& name) const {
-    auto it = values.find(name.lexeme);
-    if (it != values.end()) return it->second;
-    if (parent) return parent->Get(name);
-    throw RuntimeError("Undefined variable: " + name.lexeme);
+// Encodes a value in a compact tagged binary format. Lists are numbered in the
+// order they are first written; further occurrences of the same list (shared or
+// cyclic) are written as back-references, so structure is preserved.
+class ValueWriter {
+ public:
+  static std::string Encode(const Value& v) {
+    ValueWriter w;
+    w.out_.assign(kSerialMagic, 4);
+    w.Write(v, 0);
+    return std::move(w.out_);
   }
 
-  void Assign(const Token& name, Value v) {
-    auto it = values.find(name.lexeme);
-    if (it != values.end()) {
-      it->second = std::move(v);
-      return;
+  // Lists nested deeper than this are refused, as by JsonParser, so neither side recurses
+  // without bound.
+  static constexpr int kMaxDepth = 512;
+
+ private:
+  void Write(const Value& v, int depth) {
+    if (IsNil(v)) {
+      Put(SerialTag::Nil);
+    } else if (IsBool(v)) {
+      Put(std::get<bool>(v.v) ? SerialTag::True : SerialTag::False);
+    } else if (IsNumber(v)) {
+      double x = std::get<double>(v.v);
+      if (x == std::trunc(x) && std::fabs(x) < 9007199254740992.0 && !(x == 0 && std::signbit(x))) {
+        Put(SerialTag::Int);
+        auto i = static_cast<std::int64_t>(x);
+        PutVarint((static_cast<std::uint64_t>(i) << 1) ^ static_cast<std::uint64_t>(i >> 63));
+      } else {
+        Put(SerialTag::Number);
+        char bytes[sizeof(double)];
+        std::memcpy(bytes, &x, sizeof(double));
+        out_.append(bytes, sizeof(double));
+      }
+    } else if (IsString(v)) {
+      const std::string& str = std::get<std::string>(v.v);
+      Put(SerialTag::String);
+      PutVarint(str.size());
+      out_ += str;
+    } else if (IsList(v)) {
+      const ListValue* l = std::get<std::shared_ptr<ListValue>>(v.v).get();
+      auto it = lists_.find(l);
+      if (it != lists_.end()) {
+        Put(SerialTag::ListRef);
+        PutVarint(it->second);
+        return;
+      }
+      if (depth >= kMaxDepth) throw RuntimeError("Cannot serialize: lists nested too deeply");
+      lists_.emplace(l, lists_.size());
+      Put(l->is_object ? SerialTag::Object : SerialTag::List);
+      PutVarint(l->items.size());
+      for (const auto& item : l->items) Write(item, depth + 1);
+    } else {
+      throw RuntimeError("Cannot serialize a function");
     }
-    if (parent) {
-      parent->Assign(name, std::move(v));
-      return;
+  }
+
+  void Put(SerialTag t) { out_.push_back(static_cast<char>(t)); }
+
+  void PutVarint(std::uint64_t x) {
+    while (x >= 0x80) {
+      out_.push_back(static_cast<char>((x & 0x7F) | 0x80));
+      x >>= 7;
     }
-    throw RuntimeError("Undefined variable: " + name.lexeme);
+    out_.push_back(static_cast<char>(x));
   }
-};
 
-struct ReturnSignal {
-  Value value;
+  std::string out_;
+  std::unordered_map<const ListValue*, std::uint64_t> lists_;
 };
 
-class Interpreter {
+// Decodes the format written by ValueWriter directly from a byte range (e.g. a mapped file).
+class ValueReader {
  public:
-  Interpreter(std::ostream& out, std::ostream& err, std::string input)
-      : out_(out), err_(err), globals_(std::make_shared<Environment>()), env_(globals_) {
-    globals_->Define("input", Value::Str(std::move(input)));
-    InstallBuiltins();
+  static Value Decode(const char* data, std::size_t size) {
+    if (size < 4 || std::memcmp(data, kSerialMagic, 4) != 0) throw RuntimeError("Not serialized potato data");
+    ValueReader r(data + 4, data + size);
+    Value v = r.Read(0);
+    if (r.p_ != r.end_) throw RuntimeError("Corrupt serialized data");
+    return v;
   }
 
-  // Run the interpreter on the provided AST.
-  // Returns 0 on success, 1 on runtime error.
-  int Run(const std::vector<StmtPtr>& program) {
-    try {
-      for (const auto& s : program) Execute(s.get());
-      return 0;
-    } catch (const RuntimeError& e) {
-      err_ << "Runtime error: " << e.what() << "\n";
-      return 1;
+ private:
+  ValueReader(const char* p, const char* end) : p_(p), end_(end) {}
+
+  Value Read(int depth) {
+    if (p_ == end_) Corrupt();
+    auto tag = static_cast<SerialTag>(*p_++);
+    switch (tag) {
+      case SerialTag::Nil: return Value::Nil();
+      case SerialTag::False: return Value::Bool(false);
+      case SerialTag::True: return Value::Bool(true);
+      case SerialTag::Int: {
+        std::uint64_t z = GetVarint();
+        auto i = static_cast<std::int64_t>(z >> 1) ^ -static_cast<std::int64_t>(z & 1);
+        return Value::Number(static_cast<double>(i));
+      }
+      case SerialTag::Number: {
+        if (static_cast<std::size_t>(end_ - p_) < sizeof(double)) Corrupt();
+        double x;
+        std::memcpy(&x, p_, sizeof(double));
+        p_ += sizeof(double);
+        return Value::Number(x);
+      }
+      case SerialTag::String: {
+        std::uint64_t n = GetVarint();
+        if (n > static_cast<std::uint64_t>(end_ - p_)) Corrupt();
+        std::string str(p_, static_cast<std::size_t>(n));
+        p_ += n;
+        return Value::Str(std::move(str));
+      }
+      case SerialTag::List:
+      case SerialTag::Object: {
+        std::uint64_t n = GetVarint();
+        if (n > static_cast<std::uint64_t>(end_ - p_) || depth >= ValueWriter::kMaxDepth) Corrupt();
+        auto l = std::make_shared<ListValue>();
+        l->is_object = tag == SerialTag::Object;
+        lists_.push_back(l);
+        l->items.reserve(static_cast<std::size_t>(n));
+        for (std::uint64_t i = 0; i < n; i++) l->items.push_back(Read(depth + 1));
+        return Value::List(l);
+      }
+      case SerialTag::ListRef: {
+        std::uint64_t id = GetVarint();
+        if (id >= lists_.size()) Corrupt();
+        return Value::List(lists_[static_cast<std::size_t>(id)]);
+      }
     }
+    Corrupt();
   }
 
- private:
-  // Install built-in native functions into the global scope.
-  void InstallBuiltins() {
-    auto add = [&](std::string name, int arity, std::function<Value(const std::vector<Value>&)> fn) {
-      auto nf = std::make_shared<NativeFunctionValue>();
-      nf->name = std::move(name);
-      nf->arity = arity;
-      nf->fn = std::move(fn);
-      globals_->Define(nf->name, Value::Native(nf));
-    };
+  std::uint64_t GetVarint() {
+    std::uint64_t x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p_ == end_) Corrupt();
+      auto b = static_cast<unsigned char>(*p_++);
+      x |= static_cast<std::uint64_t>(b & 0x7F) << shift;
+      if (!(b & 0x80)) return x;
+    }
+    Corrupt();
+  }
 
-    // Creates a new empty list.
-    add("list", 0, [&](const std::vector<Value>&) { return Value::List(std::make_shared<ListValue>()); });
-    
-    // Pushes an item to the end of a list.
-    add("push", 2, [&](const std::vector<Value>& args) {
-      auto l = AsList(args[0]);
-      l->items.push_back(args[1]);
-      return args[0];
-    });
-    
-    // Gets an item from a list by index.
-    add("get", 2, [&](const std::vector<Value>& args) {
-      auto l = AsList(args[0]);
-      int i = static_cast<int>(AsNumber(args[1]));
-      if (i < 0 || i >= static_cast<int>(l->items.size())) return Value::Nil();
-      return l->items[static_cast<std::size_t>(i)];
-    });
-    
-    // Sets an item in a list by index.
-    add("set", 3, [&](const std::vector<Value>& args) {
-      auto l = AsList(args[0]);
-      int i = static_cast<int>(AsNumber(args[1]));
-      if (i < 0 || i >= static_cast<int>(l->items.size())) throw RuntimeError("Index out of range");
-      l->items[static_cast<std::size_t>(i)] = args[2];
-      return args[0];
-    });
+  [[noreturn]] static void Corrupt() { throw RuntimeError("Corrupt serialized data"); }
 
-    // Removes an item from a list by index.
-    add("remove_at", 2, [&](const std::vector<Value>& args) {
-      auto l = AsList(args[0]);
-      int i = static_cast<int>(AsNumber(args[1]));
-      if (i < 0 || i >= static_cast<int>(l->items.size())) throw RuntimeError("Index out of range");
-      l->items.erase(l->items.begin() + i);
-      return Value::Nil();
-    });
-    
-    // Returns the length of a string or list.
-    add("len", 1, [&](const std::vector<Value>& args) {
-      if (IsString(args[0])) return Value::Number(static_cast<double>(AsString(args[0]).size()));
-      if (IsList(args[0])) return Value::Number(static_cast<double>(AsList(args[0])->items.size()));
-      throw RuntimeError("len() expects string or list");
-    });
-    // Returns a substring of a string.
-    add("substr", 3, [&](const std::vector<Value>& args) {
-      const std::string& s = AsString(args[0]);
-      int start = static_cast<int>(AsNumber(args[1]));
-      int count = static_cast<int>(AsNumber(args[2]));
-      if (count <= 0) return Value::Str("");
-      if (start < 0) start = 0;
-      if (start > static_cast<int>(s.size())) start = static_cast<int>(s.size());
-      int end = start + count;
-      if (end > static_cast<int>(s.size())) end = static_cast<int>(s.size());
-      return Value::Str(s.substr(static_cast<std::size_t>(start), static_cast<std::size_t>(end - start)));
-    });
+  const char* p_;
+  const char* end_;
+  std::vector<std::shared_ptr<ListValue>> lists_;
+};
 
-    // Returns the character at a specific index in a string.
-    add("char_at", 2, [&](const std::vector<Value>& args) {
-      const std::string& s = AsString(args[0]);
-      int i = static_cast<int>(AsNumber(args[1]));
-      if (i < 0 || i >= static_cast<int>(s.size())) return Value::Str("");
-      return Value::Str(s.substr(static_cast<std::size_t>(i), 1));
-    });
+// Parses JSON text into values: arrays become lists, objects become lists of
+// [key, value] pairs flagged is_object, null becomes nil.
+class JsonParser {
+ public:
+  static Value Parse(const char* data, std::size_t size) {
+    JsonParser p(data, data + size);
+    p.SkipWhitespace();
+    Value v = p.ParseValue(0);
+    p.SkipWhitespace();
+    if (p.p_ != p.end_) p.Fail("unexpected trailing characters");
+    return v;
+  }
 
-    // Converts any value to a string representation.
-    add("to_string", 1, [&](const std::vector<Value>& args) { return Value::Str(ValueToString(args[0])); });
-    
-    // Writes a string to standard output.
-    add("write", 1, [&](const std::vector<Value>& args) {
-      out_ << ValueToString(args[0]);
-      out_.flush();
-      return Value::Nil();
-    });
+ private:
+  static constexpr int kMaxDepth = 512;
+
+  JsonParser(const char* begin, const char* end) : begin_(begin), p_(begin), end_(end) {}
+
+  Value ParseValue(int depth) {
+    if (p_ == end_) Fail("unexpected end of input");
+    switch (*p_) {
+      case '{': return ParseObject(depth + 1);
+      case '[': return ParseArray(depth + 1);
+      case '"': return Value::Str(ParseString());
+      case 't': Expect("true"); return Value::Bool(true);
+      case 'f': Expect("false"); return Value::Bool(false);
+      case 'n': Expect("null"); return Value::Nil();
+      default: return ParseNumber();
+    }
+  }
 
-    // Checks if a string contains only digits.
-    add("is_digit", 1, [&](const std::vector<Value>& args) {
-      const std::string& s = AsString(args[0]);
-      if (s.size() != 1) return Value::Bool(false);
-      return Value::Bool(std::isdigit(static_cast<unsigned char>(s[0])) != 0);
-    });
+  Value ParseArray(int depth) {
+    if (depth > kMaxDepth) Fail("nesting too deep");
+    ++p_;
+    auto l = std::make_shared<ListValue>();
+    SkipWhitespace();
+    if (p_ != end_ && *p_ == ']') {
+      ++p_;
+      return Value::List(l);
+    }
+    while (true) {
+      SkipWhitespace();
+      l->items.push_back(ParseValue(depth));
+      SkipWhitespace();
+      if (p_ != end_ && *p_ == ',') {
+        ++p_;
+        continue;
+      }
+      if (p_ != end_ && *p_ == ']') {
+        ++p_;
+        return Value::List(l);
+      }
+      Fail("expected ',' or ']'");
+    }
+  }
 
-    // Checks if a string contains only alphabetic characters.
-    add("is_alpha", 1, [&](const std::vector<Value>& args) {
-      const std::string& s = AsString(args[0]);
-      if (s.size() != 1) return Value::Bool(false);
-      return Value::Bool(std::isalpha(static_cast<unsigned char>(s[0])) != 0 || s[0] == '_');
-    });
+  Value ParseObject(int depth) {
+    if (depth > kMaxDepth) Fail("nesting too deep");
+    ++p_;
+    auto obj = std::make_shared<ListValue>();
+    obj->is_object = true;
+    SkipWhitespace();
+    if (p_ != end_ && *p_ == '}') {
+      ++p_;
+      return Value::List(obj);
+    }
+    while (true) {
+      SkipWhitespace();
+      if (p_ == end_ || *p_ != '"') Fail("expected object key");
+      auto pair = std::make_shared<ListValue>();
+      pair->items.reserve(2);
+      pair->items.push_back(Value::Str(ParseString()));
+      SkipWhitespace();
+      if (p_ == end_ || *p_ != ':') Fail("expected ':'");
+      ++p_;
+      SkipWhitespace();
+      pair->items.push_back(ParseValue(depth));
+      obj->items.push_back(Value::List(pair));
+      SkipWhitespace();
+      if (p_ != end_ && *p_ == ',') {
+        ++p_;
+        continue;
+      }
+      if (p_ != end_ && *p_ == '}') {
+        ++p_;
+        return Value::List(obj);
+      }
+      Fail("expected ',' or '}'");
+    }
+  }
 
-    // Checks if a string contains only alphanumeric characters.
-    add("is_alnum", 1, [&](const std::vector<Value>& args) {
-      const std::string& s = AsString(args[0]);
-      if (s.size() != 1) return Value::Bool(false);
-      return Value::Bool(std::isalnum(static_cast<unsigned char>(s[0])) != 0 || s[0] == '_');
-    });
+  std::string ParseString() {
+    ++p_;
+    std::string out;
+    while (true) {
+      // Copy the run of plain bytes up to the next quote or escape in one go.
+      const char* run = p_;
+      while (p_ != end_ && *p_ != '"' && *p_ != '\\') {
+        if (static_cast<unsigned char>(*p_) < 0x20) Fail("control character in string");
+        ++p_;
+      }
+      out.append(run, static_cast<std::size_t>(p_ - run));
+      if (p_ == end_) Fail("unterminated string");
+      if (*p_++ == '"') return out;
+      if (p_ == end_) Fail("unterminated string");
+      char e = *p_++;
+      switch (e) {
+        case '"': out.push_back('"'); break;
+        case '\\': out.push_back('\\'); break;
+        case '/': out.push_back('/'); break;
+        case 'b': out.push_back('\b'); break;
+        case 'f': out.push_back('\f'); break;
+        case 'n': out.push_back('\n'); break;
+        case 'r': out.push_back('\r'); break;
+        case 't': out.push_back('\t'); break;
+        case 'u': AppendUtf8(out, ParseUnicodeEscape()); break;
+        default: Fail("invalid escape");
+      }
+    }
+  }
 
-    // Converts a number to an integer (truncates decimal part).
-    add("int", 1, [&](const std::vector<Value>& args) {
-      return Value::Number(static_cast<double>(static_cast<long long>(AsNumber(args[0]))));
-    });
+  unsigned ParseHex4() {
+    if (end_ - p_ < 4) Fail("invalid \\u escape");
+    unsigned cp = 0;
+    for (int i = 0; i < 4; i++) {
+      char c = *p_++;
+      cp <<= 4;
+      if (c >= '0' && c <= '9') cp |= static_cast<unsigned>(c - '0');
+      else if (c >= 'a' && c <= 'f') cp |= static_cast<unsigned>(c - 'a' + 10);
+      else if (c >= 'A' && c <= 'F') cp |= static_cast<unsigned>(c - 'A' + 10);
+      else Fail("invalid \\u escape");
+    }
+    return cp;
+  }
 
-    // Reads a line from standard input.
-    add("read_line", 0, [&](const std::vector<Value>&) {
-      std::string line;
-      if (std::getline(std::cin, line)) {
-        return Value::Str(line);
-      }
-      return Value::Nil();
-    });
+  unsigned ParseUnicodeEscape() {
+    unsigned cp = ParseHex4();
+    if (cp >= 0xD800 && cp <= 0xDBFF && end_ - p_ >= 6 && p_[0] == '\\' && p_[1] == 'u') {
+      const char* save = p_;
+      p_ += 2;
+      unsigned lo = ParseHex4();
+      if (lo >= 0xDC00 && lo <= 0xDFFF) return 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+      p_ = save;
+    }
+    return cp;
+  }
 
-    // Sleeps for N milliseconds.
-    add("sleep", 1, [&](const std::vector<Value>& args) {
-      int ms = static_cast<int>(AsNumber(args[0]));
-      if (ms > 0) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  static void AppendUtf8(std::string& out, unsigned cp) {
+    if (cp < 0x80) {
+      out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+      out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+      out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+      out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+      out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+      out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+      out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+  }
+
+  Value ParseNumber() {
+    const char* start = p_;
+    if (p_ != end_ && *p_ == '-') ++p_;
+    if (p_ == end_ || !std::isdigit(static_cast<unsigned char>(*p_))) Fail("unexpected character");
+    if (*p_ == '0' && p_ + 1 != end_ && std::isdigit(static_cast<unsigned char>(p_[1]))) Fail("leading zero in number");
+    // Up to 15 digits are summed exactly as an integer; anything longer goes to strtod.
+    bool simple = true;
+    std::int64_t whole = 0;
+    int digits = 0;
+    while (p_ != end_ && std::isdigit(static_cast<unsigned char>(*p_))) {
+      if (++digits > 15) simple = false;
+      if (simple) whole = whole * 10 + (*p_ - '0');
+      ++p_;
+    }
+    // -0 has to keep its sign, which the integer path would lose.
+    if (whole == 0 && *start == '-') simple = false;
+    if (p_ != end_ && (*p_ == '.' || *p_ == 'e' || *p_ == 'E')) {
+      simple = false;
+      if (*p_ == '.') {
+        ++p_;
+        SkipDigits();
       }
-      return Value::Nil();
-    });
-    
-    // Returns a random number between 0 and 1.
-    add("random", 0, [&](const std::vector<Value>&) {
-      static std::mt19937 rng(std::random_device{}());
-      static std::uniform_real_distribution<double> dist(0.0, 1.0);
-      return Value::Number(dist(rng));
-    });
-    
-    // Execute a shell command and return its output
-    add("exec", 1, [&](const std::vector<Value>& args) {
-        std::string cmd = AsString(args[0]);
-        std::array<char, 128> buffer;
-        std::string result;
-        // Use popen to capture output
-        std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
-        if (!pipe) {
-            return Value::Str("popen() failed!");
-        }
-        while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-            result += buffer.data();
-        }
-        return Value::Str(result);
-    });
+      if (p_ != end_ && (*p_ == 'e' || *p_ == 'E')) {
+        ++p_;
+        if (p_ != end_ && (*p_ == '+' || *p_ == '-')) ++p_;
+        SkipDigits();
+      }
+    }
+    if (simple) return Value::Number(static_cast<double>(*start == '-' ? -whole : whole));
+    std::string text(start, static_cast<std::size_t>(p_ - start));
+    return Value::Number(std::strtod(text.c_str(), nullptr));
+  }
 
-    // Returns current timestamp in seconds.
-    add("time", 0, [&](const std::vector<Value>&) {
-        auto now = std::chrono::system_clock::now();
-        auto duration = now.time_since_epoch();
-        double seconds = std::chrono::duration_cast<std::chrono::duration<double>>(duration).count();
-        return Value::Number(seconds);
-    });
+  // Skips the digits after '.' or an exponent, of which JSON requires at least one.
+  void SkipDigits() {
+    if (p_ == end_ || !std::isdigit(static_cast<unsigned char>(*p_))) Fail("expected digit");
+    while (p_ != end_ && std::isdigit(static_cast<unsigned char>(*p_))) ++p_;
+  }
 
-    // Returns a string containing a single character with the given ASCII code.
-    add("char", 1, [&](const std::vector<Value>& args) {
-        int code = static_cast<int>(AsNumber(args[0]));
-        return Value::Str(std::string(1, static_cast<char>(code)));
-    });
+  void Expect(const char* word) {
+    std::size_t n = std::strlen(word);
+    if (static_cast<std::size_t>(end_ - p_) < n || std::memcmp(p_, word, n) != 0) Fail("unexpected character");
+    p_ += n;
+  }
 
-    // Execute a system command
-    add("system", 1, [&](const std::vector<Value>& args) {
-        std::string cmd = AsString(args[0]);
-        int ret = std::system(cmd.c_str());
-        return Value::Number(static_cast<double>(ret));
-    });
+  void SkipWhitespace() {
+    while (p_ != end_ && (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t')) ++p_;
+  }
 
-    // Initialize Graphics Window
-    add("graphics_init", 3, [&](const std::vector<Value>& args) {
-        int w = static_cast<int>(AsNumber(args[0]));
-        int h = static_cast<int>(AsNumber(args[1]));
-        std::string title = AsString(args[2]);
-        if (SDL_Init(SDL_INIT_VIDEO) < 0) return Value::Bool(false);
-        g_window = SDL_CreateWindow(title.c_str(), SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, w, h, SDL_WINDOW_SHOWN);
-        if (!g_window) return Value::Bool(false);
-        g_renderer = SDL_CreateRenderer(g_window, -1, SDL_RENDERER_ACCELERATED);
-        return Value::Bool(g_renderer != nullptr);
-    });
+  [[noreturn]] void Fail(const std::string& message) const {
+    throw RuntimeError("JSON parse error at offset " + std::to_string(p_ - begin_) + ": " + message);
+  }
 
-    // Set Draw Color
-    add("graphics_color", 3, [&](const std::vector<Value>& args) {
-        int r = static_cast<int>(AsNumber(args[0]));
+  const char* begin_;
+  const char* p_;
+  const char* end_;
+};
+
+// Serializes values as JSON. Lists flagged is_object are written as objects.
+class JsonWriter {
+ public:
+  static std::string Write(const Value& v) {
+    JsonWriter w;
+    w.WriteValue(v, 0);
+    return std::move(w.out_);
+  }
+
+ private:
+  void WriteValue(const Value& v, int depth) {
+    if (depth > 512) throw RuntimeError("json_stringify: nesting too deep (cyclic list?)");
+    if (IsNil(v)) {
+      out_ += "null";
+    } else if (IsBool(v)) {
+      out_ += std::get<bool>(v.v) ? "true" : "false";
+    } else if (IsNumber(v)) {
+      double x = std::get<double>(v.v);
+      out_ += std::isfinite(x) ? NumberToString(x) : "null";
+    } else if (IsString(v)) {
+      WriteString(std::get<std::string>(v.v));
+    } else if (IsList(v)) {
+      const ListValue& l = *std::get<std::shared_ptr<ListValue>>(v.v);
+      out_.push_back(l.is_object ? '{' : '[');
+      for (std::size_t i = 0; i < l.items.size(); i++) {
+        if (i > 0) out_.push_back(',');
+        if (!l.is_object) {
+          WriteValue(l.items[i], depth + 1);
+          continue;
+        }
+        if (!IsList(l.items[i]) || AsList(l.items[i])->items.size() != 2 || !IsString(AsList(l.items[i])->items[0])) {
+          throw RuntimeError("json_stringify: object entries must be [key, value] pairs");
+        }
+        const ListValue& pair = *AsList(l.items[i]);
+        WriteString(std::get<std::string>(pair.items[0].v));
+        out_.push_back(':');
+        WriteValue(pair.items[1], depth + 1);
+      }
+      out_.push_back(l.is_object ? '}' : ']');
+    } else {
+      throw RuntimeError("json_stringify: cannot serialize a function");
+    }
+  }
+
+  void WriteString(const std::string& s) {
+    static const char kHex[] = "0123456789abcdef";
+    out_.push_back('"');
+    for (char c : s) {
+      switch (c) {
+        case '"': out_ += "\\\""; break;
+        case '\\': out_ += "\\\\"; break;
+        case '\n': out_ += "\\n"; break;
+        case '\r': out_ += "\\r"; break;
+        case '\t': out_ += "\\t"; break;
+        case '\b': out_ += "\\b"; break;
+        case '\f': out_ += "\\f"; break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            out_ += "\\u00";
+            out_.push_back(kHex[(c >> 4) & 0xF]);
+            out_.push_back(kHex[c & 0xF]);
+          } else {
+            out_.push_back(c);
+          }
+      }
+    }
+    out_.push_back('"');
+  }
+
+  std::string out_;
+};
+
+// Finds key in an object stored as [key, value] pairs; returns nullptr if missing.
+static Value* FindObjectKey(ListValue& obj, const std::string& key) {
+  for (auto& entry : obj.items) {
+    if (!IsList(entry)) continue;
+    auto& pair = std::get<std::shared_ptr<ListValue>>(entry.v)->items;
+    if (pair.size() == 2 && IsString(pair[0]) && std::get<std::string>(pair[0].v) == key) return &pair[1];
+  }
+  return nullptr;
+}
+
+// Splits a top-level JSON array into the text of its elements, pulling input in
+// chunks so arrays larger than memory can be processed one element at a time.
+class JsonArrayStream {
+ public:
+  // next_chunk returns more input, or an empty string at end of input.
+  explicit JsonArrayStream(std::function<std::string()> next_chunk) : next_chunk_(std::move(next_chunk)) {}
+
+  // Stores the next element's text in element; returns false after the closing ']'.
+  bool Next(std::string& element) {
+    element.clear();
+    if (done_) return false;
+    if (!started_) {
+      if (!SkipWhitespace() || buf_[pos_] != '[') Fail("expected '[' at start of stream");
+      pos_++;
+      started_ = true;
+      if (SkipWhitespace() && buf_[pos_] == ']') {
+        pos_++;
+        done_ = true;
+        return false;
+      }
+    }
+    if (!SkipWhitespace()) Fail("unexpected end of input");
+    int depth = 0;
+    bool in_string = false;
+    while (true) {
+      if (pos_ == buf_.size() && !Refill()) Fail("unexpected end of input");
+      char c = buf_[pos_];
+      if (in_string) {
+        if (c == '\\') {
+          element.push_back(c);
+          pos_++;
+          if (pos_ == buf_.size() && !Refill()) Fail("unexpected end of input");
+          c = buf_[pos_];
+        } else if (c == '"') {
+          in_string = false;
+        }
+      } else if (c == '"') {
+        in_string = true;
+      } else if (c == '[' || c == '{') {
+        depth++;
+      } else if (c == ']' || c == '}') {
+        if (depth == 0) {
+          if (c != ']') Fail("unexpected '}'");
+          pos_++;
+          done_ = true;
+          return true;
+        }
+        depth--;
+      } else if (c == ',' && depth == 0) {
+        pos_++;
+        return true;
+      }
+      element.push_back(c);
+      pos_++;
+    }
+  }
+
+ private:
+  bool Refill() {
+    buf_ = next_chunk_();
+    pos_ = 0;
+    return !buf_.empty();
+  }
+
+  // Skips whitespace, refilling as needed; returns false at end of input.
+  bool SkipWhitespace() {
+    while (true) {
+      if (pos_ == buf_.size() && !Refill()) return false;
+      char c = buf_[pos_];
+      if (c != ' ' && c != '\n' && c != '\r' && c != '\t') return true;
+      pos_++;
+    }
+  }
+
+  [[noreturn]] static void Fail(const std::string& message) { throw RuntimeError("JSON stream error: " + message); }
+
+  std::function<std::string()> next_chunk_;
+  std::string buf_;
+  std::size_t pos_ = 0;
+  bool started_ = false;
+  bool done_ = false;
+};
+
+// A 256-entry byte membership table used by the scan_* builtins.
+struct ByteSet {
+  bool bits[256] = {};
+
+  bool Has(char c) const { return bits[static_cast<unsigned char>(c)]; }
+
+  static ByteSet FromChars(const std::string& chars) {
+    ByteSet set;
+    for (char c : chars) set.bits[static_cast<unsigned char>(c)] = true;
+    return set;
+  }
+
+  static ByteSet FromPredicate(int (*pred)(int), const char* extra = "") {
+    ByteSet set;
+    for (int c = 0; c < 256; c++) set.bits[c] = pred(c) != 0;
+    for (const char* p = extra; *p; p++) set.bits[static_cast<unsigned char>(*p)] = true;
+    return set;
+  }
+
+  // Returns the table for a named class ("digit", "alpha", "ident", "space"),
+  // or nullptr if the name is not a known class.
+  static const ByteSet* Named(const std::string& name) {
+    static const ByteSet kDigit = FromPredicate(isdigit);
+    static const ByteSet kAlpha = FromPredicate(isalpha, "_");
+    static const ByteSet kIdent = FromPredicate(isalnum, "_");
+    static const ByteSet kSpace = FromChars(" \t\r\n");
+    if (name == "digit") return &kDigit;
+    if (name == "alpha") return &kAlpha;
+    if (name == "ident") return &kIdent;
+    if (name == "space") return &kSpace;
+    return nullptr;
+  }
+};
+
+// Clamps a script-provided offset into [0, size].
+static std::size_t ClampOffset(const Value& v, std::size_t size) {
+  double d = AsNumber(v);
+  if (!(d > 0)) return 0;
+  if (d >= static_cast<double>(size)) return size;
+  return static_cast<std::size_t>(d);
+}
+
+// Allocator that keeps freed single-object blocks on a per-thread free list, so hot
+// objects like call frames reuse memory instead of going through malloc each time.
+template <typename T>
+struct RecyclingAllocator {
+  using value_type = T;
+
+  RecyclingAllocator() = default;
+  template <typename U>
+  RecyclingAllocator(const RecyclingAllocator<U>&) {}
+
+  T* allocate(std::size_t n) {
+    if (n == 1) {
+      auto& blocks = FreeList().blocks;
+      if (!blocks.empty()) {
+        void* p = blocks.back();
+        blocks.pop_back();
+        return static_cast<T*>(p);
+      }
+    }
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    if (n == 1) {
+      auto& blocks = FreeList().blocks;
+      if (blocks.size() < kMaxFree) {
+        blocks.push_back(p);
+        return;
+      }
+    }
+    ::operator delete(p);
+  }
+
+  template <typename U>
+  bool operator==(const RecyclingAllocator<U>&) const { return true; }
+  template <typename U>
+  bool operator!=(const RecyclingAllocator<U>&) const { return false; }
+
+ private:
+  static constexpr std::size_t kMaxFree = 4096;
+
+  struct Blocks {
+    std::vector<void*> blocks;
+    ~Blocks() {
+      for (void* p : blocks) ::operator delete(p);
+    }
+  };
+
+  static Blocks& FreeList() {
+    static thread_local Blocks list;
+    return list;
+  }
+};
+
+struct Environment {
+  // Function and block scopes keep their first few variables inline. Their names point at
+  // the declaring token in the AST, which outlives every scope created from it.
+  static constexpr std::size_t kInlineSlots = 6;
+  struct Slot {
+    const std::string* name = nullptr;
+    Value value;
+  };
+  Slot slots[kInlineSlots];
+  std::size_t slot_count = 0;
+  std::unordered_map<std::string, Value> values;
+  // Variables whose value is computed on first access (e.g. the global `input`).
+  std::unordered_map<std::string, std::function<Value()>> lazy;
+  std::shared_ptr<Environment> parent;
+  // The parallel worker that created this scope (see ParallelToken).
+  std::uint64_t owner = ParallelToken();
+
+  explicit Environment(std::shared_ptr<Environment> p = nullptr) : parent(std::move(p)) {}
+
+  // False inside a parallel worker for scopes the worker did not create.
+  bool Writable() const { return ParallelToken() == 0 || owner == ParallelToken(); }
+
+  // Creates a child scope from recycled memory.
+  static std::shared_ptr<Environment> Make(std::shared_ptr<Environment> p) {
+    return std::allocate_shared<Environment>(RecyclingAllocator<Environment>(), std::move(p));
+  }
+
+  void Define(const std::string& name, Value v) {
+    if (!Writable()) throw RuntimeError("Cannot modify shared variable inside a parallel worker: " + name);
+    if (Value* slot = FindSlot(name)) {
+      *slot = std::move(v);
+      return;
+    }
+    if (!lazy.empty()) lazy.erase(name);
+    values[name] = std::move(v);
+  }
+
+  // Like Define, but name must outlive this scope (a token lexeme in the AST).
+  void DefineLocal(const std::string& name, Value v) {
+    if (parent && slot_count < kInlineSlots && values.empty()) {
+      if (!Writable()) throw RuntimeError("Cannot modify shared variable inside a parallel worker: " + name);
+      if (Value* slot = FindSlot(name)) {
+        *slot = std::move(v);
+        return;
+      }
+      slots[slot_count].name = &name;
+      slots[slot_count].value = std::move(v);
+      slot_count++;
+      return;
+    }
+    Define(name, std::move(v));
+  }
+
+  void DefineLazy(const std::string& name, std::function<Value()> fn) {
+    values.erase(name);
+    lazy[name] = std::move(fn);
+  }
+
+  Value Get(const Token& name) {
+    if (Value* slot = FindSlot(name.lexeme)) return *slot;
+    if (!values.empty()) {
+      auto it = values.find(name.lexeme);
+      if (it != values.end()) return it->second;
+    }
+    if (!lazy.empty()) {
+      auto lit = lazy.find(name.lexeme);
+      if (lit != lazy.end()) {
+        if (!Writable()) throw RuntimeError("Variable is not available inside a parallel worker: " + name.lexeme);
+        std::function<Value()> fn = std::move(lit->second);
+        lazy.erase(lit);
+        return values[name.lexeme] = fn();
+      }
+    }
+    if (parent) return parent->Get(name);
+    throw RuntimeError("Undefined variable: " + name.lexeme);
+  }
+
+  // Reads a variable expected to hold a number. Returns false if it holds something else
+  // or needs Get (lazy or undefined), leaving the caller to fall back to Get.
+  bool GetNumber(const Token& name, double& out) {
+    for (Environment* env = this; env; env = env->parent.get()) {
+      const Value* v = env->FindSlot(name.lexeme);
+      if (!v && !env->values.empty()) {
+        auto it = env->values.find(name.lexeme);
+        if (it != env->values.end()) v = &it->second;
+      }
+      if (v) {
+        const double* d = std::get_if<double>(&v->v);
+        if (d) out = *d;
+        return d != nullptr;
+      }
+      if (!env->lazy.empty() && env->lazy.count(name.lexeme) > 0) return false;
+    }
+    return false;
+  }
+
+  void Assign(const Token& name, Value v) {
+    Value* target = FindSlot(name.lexeme);
+    if (!target && !values.empty()) {
+      auto it = values.find(name.lexeme);
+      if (it != values.end()) target = &it->second;
+    }
+    if (target) {
+      if (!Writable()) throw RuntimeError("Cannot modify shared variable inside a parallel worker: " + name.lexeme);
+      *target = std::move(v);
+      return;
+    }
+    if (!lazy.empty() && lazy.count(name.lexeme) > 0) {
+      if (!Writable()) throw RuntimeError("Cannot modify shared variable inside a parallel worker: " + name.lexeme);
+      lazy.erase(name.lexeme);
+      values[name.lexeme] = std::move(v);
+      return;
+    }
+    if (parent) {
+      parent->Assign(name, std::move(v));
+      return;
+    }
+    throw RuntimeError("Undefined variable: " + name.lexeme);
+  }
+
+ private:
+  Value* FindSlot(const std::string& name) {
+    for (std::size_t i = 0; i < slot_count; i++) {
+      if (slots[i].name == &name || *slots[i].name == name) return &slots[i].value;
+    }
+    return nullptr;
+  }
+};
+
+// Reads a whole file into out with a single presized buffer. Returns false if it cannot be opened.
+static bool ReadWholeFile(const std::string& path, std::string& out) {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    ::close(fd);
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return false;
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    out = ss.str();
+    return true;
+  }
+  out.resize(static_cast<std::size_t>(st.st_size));
+  std::size_t done = 0;
+  while (done < out.size()) {
+    ssize_t n = ::pread(fd, &out[done], out.size() - done, static_cast<off_t>(done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += static_cast<std::size_t>(n);
+  }
+  out.resize(done);
+  ::close(fd);
+  return true;
+#else
+  std::ifstream f(path, std::ios::binary | std::ios::ate);
+  if (!f) return false;
+  out.resize(static_cast<std::size_t>(f.tellg()));
+  f.seekg(0);
+  f.read(&out[0], static_cast<std::streamsize>(out.size()));
+  out.resize(static_cast<std::size_t>(f.gcount()));
+  return true;
+#endif
+}
+
+// A read-only view of a whole file. Regular files are memory-mapped; anything
+// that cannot be mapped is read into memory instead.
+class MappedFile {
+ public:
+  // Returns nullptr if the file cannot be opened.
+  static std::unique_ptr<MappedFile> Open(const std::string& path) {
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    std::unique_ptr<MappedFile> mapped = FromFd(fd);
+    ::close(fd);
+    if (mapped) return mapped;
+#endif
+    std::unique_ptr<MappedFile> f(new MappedFile());
+    if (!ReadWholeFile(path, f->owned_)) return nullptr;
+    f->data_ = f->owned_.data();
+    f->size_ = f->owned_.size();
+    return f;
+  }
+
+#ifndef _WIN32
+  // Maps fd if it refers to a regular file, otherwise returns nullptr. The caller keeps ownership of fd.
+  static std::unique_ptr<MappedFile> FromFd(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return nullptr;
+    std::unique_ptr<MappedFile> f(new MappedFile());
+    f->size_ = static_cast<std::size_t>(st.st_size);
+    if (f->size_ == 0) return f;
+    void* p = mmap(nullptr, f->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return nullptr;
+    madvise(p, f->size_, MADV_SEQUENTIAL);
+    f->mapping_ = p;
+    f->data_ = static_cast<const char*>(p);
+    return f;
+  }
+#endif
+
+  ~MappedFile() {
+#ifndef _WIN32
+    if (mapping_) munmap(mapping_, size_);
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+ private:
+  MappedFile() = default;
+
+  void* mapping_ = nullptr;
+  std::string owned_;
+  const char* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+// Appends data to a file (creating it if needed) without reading it back.
+static bool AppendToFile(const std::string& path, const std::string& data) {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd < 0) return false;
+  std::size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += static_cast<std::size_t>(n);
+  }
+  ::close(fd);
+  return done == data.size();
+#else
+  std::ofstream f(path, std::ios::binary | std::ios::app);
+  if (!f) return false;
+  f << data;
+  return static_cast<bool>(f);
+#endif
+}
+
+// Exit status and captured output of a child process.
+struct ProcessResult {
+  int exit_code = 0;
+  std::string out;
+  std::string err;
+};
+
+#ifndef _WIN32
+// Writes to a pipe without raising SIGPIPE if the reader has already exited.
+static ssize_t WriteNoSigpipe(int fd, const char* data, std::size_t n) {
+  sigset_t pipe_set, old_set;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+  ssize_t r = ::write(fd, data, n);
+  if (r < 0 && errno == EPIPE) {
+    sigset_t pending;
+    sigpending(&pending);
+    if (sigismember(&pending, SIGPIPE)) {
+      int sig;
+      sigwait(&pipe_set, &sig);
+    }
+    errno = EPIPE;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+  return r;
+}
+
+// pipe(), accept() and socket() with close-on-exec set atomically, so a process spawned
+// by another thread in between cannot inherit the descriptors. macOS has no pipe2/accept4;
+// there the flag is set right after creation.
+static int PipeCloexec(int fds[2]) {
+#ifdef __APPLE__
+  if (::pipe(fds) != 0) return -1;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+#else
+  return ::pipe2(fds, O_CLOEXEC);
+#endif
+}
+
+static int AcceptCloexec(int listener) {
+#ifdef __APPLE__
+  int fd = ::accept(listener, nullptr, nullptr);
+  if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+#else
+  return ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+#endif
+}
+
+static int SocketCloexec(int domain, int type) {
+#ifdef __APPLE__
+  int fd = ::socket(domain, type, 0);
+  if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+#else
+  return ::socket(domain, type | SOCK_CLOEXEC, 0);
+#endif
+}
+#endif
+
+// Runs argv directly (no shell, PATH lookup for argv[0]) and collects its output in 64 KiB reads.
+// If stdin_data is null the child inherits standard input; if capture_err is false it inherits standard error.
+static ProcessResult RunProcess(const std::vector<std::string>& argv, const std::string* stdin_data, bool capture_err) {
+  ProcessResult result;
+#ifndef _WIN32
+  if (argv.empty()) throw RuntimeError("spawn() expects a non-empty argument list");
+  int in_pipe[2] = {-1, -1}, out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1};
+  auto close_fd = [](int& fd) {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+  };
+  auto close_all = [&]() {
+    for (int* p : {in_pipe, out_pipe, err_pipe}) {
+      close_fd(p[0]);
+      close_fd(p[1]);
+    }
+  };
+  auto make_pipe = [&](int fds[2]) {
+    if (PipeCloexec(fds) != 0) {
+      close_all();
+      throw RuntimeError("pipe() failed");
+    }
+  };
+  if (stdin_data) make_pipe(in_pipe);
+  make_pipe(out_pipe);
+  if (capture_err) make_pipe(err_pipe);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (stdin_data) posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+  if (capture_err) posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+
+  std::vector<char*> cargv;
+  cargv.reserve(argv.size() + 1);
+  for (const auto& a : argv) cargv.push_back(const_cast<char*>(a.c_str()));
+  cargv.push_back(nullptr);
+
+  pid_t pid = 0;
+  int rc = posix_spawnp(&pid, cargv[0], &actions, nullptr, cargv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (rc != 0) {
+    close_all();
+    result.exit_code = 127;
+    result.err = argv[0] + ": " + std::strerror(rc) + "\n";
+    return result;
+  }
+  close_fd(in_pipe[0]);
+  close_fd(out_pipe[1]);
+  close_fd(err_pipe[1]);
+  if (in_pipe[1] >= 0) {
+    fcntl(in_pipe[1], F_SETFL, fcntl(in_pipe[1], F_GETFL) | O_NONBLOCK);
+    if (stdin_data->empty()) close_fd(in_pipe[1]);
+  }
+
+  std::vector<char> buf(1 << 16);
+  std::size_t written = 0;
+  while (out_pipe[0] >= 0 || err_pipe[0] >= 0 || in_pipe[1] >= 0) {
+    pollfd fds[3];
+    nfds_t nfds = 0;
+    if (out_pipe[0] >= 0) fds[nfds++] = pollfd{out_pipe[0], POLLIN, 0};
+    if (err_pipe[0] >= 0) fds[nfds++] = pollfd{err_pipe[0], POLLIN, 0};
+    if (in_pipe[1] >= 0) fds[nfds++] = pollfd{in_pipe[1], POLLOUT, 0};
+    if (::poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (nfds_t i = 0; i < nfds; i++) {
+      if (!fds[i].revents) continue;
+      int fd = fds[i].fd;
+      if (fd == in_pipe[1]) {
+        ssize_t n = WriteNoSigpipe(fd, stdin_data->data() + written, stdin_data->size() - written);
+        if (n > 0) written += static_cast<std::size_t>(n);
+        if ((n < 0 && errno != EAGAIN && errno != EINTR) || written == stdin_data->size()) close_fd(in_pipe[1]);
+        continue;
+      }
+      ssize_t n = ::read(fd, buf.data(), buf.size());
+      if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+      if (n <= 0) {
+        close_fd(fd == out_pipe[0] ? out_pipe[0] : err_pipe[0]);
+        continue;
+      }
+      (fd == out_pipe[0] ? result.out : result.err).append(buf.data(), static_cast<std::size_t>(n));
+    }
+  }
+  close_all();
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  if (WIFEXITED(status)) result.exit_code = WEXITSTATUS(status);
+  else if (WIFSIGNALED(status)) result.exit_code = 128 + WTERMSIG(status);
+#else
+  (void)argv;
+  (void)stdin_data;
+  (void)capture_err;
+  throw RuntimeError("spawn() is not supported on this platform");
+#endif
+  return result;
+}
+
+// A child process running on a background thread. notify_fd becomes readable when it finishes.
+struct AsyncProcess {
+  std::thread worker;
+  ProcessResult result;
+  std::string error;
+  int notify_fd[2] = {-1, -1};
+
+  ~AsyncProcess() {
+    if (worker.joinable()) worker.join();
+#ifndef _WIN32
+    for (int fd : notify_fd) {
+      if (fd >= 0) ::close(fd);
+    }
+#endif
+  }
+};
+
+// The script's input data. Regular files are memory-mapped, pipes are read
+// through a large buffer, so scripts can stream input without holding it all.
+class InputSource {
+ public:
+  static constexpr std::size_t kStreamBufferSize = 1 << 20;
+
+  static std::shared_ptr<InputSource> FromString(std::string data) {
+    auto src = std::shared_ptr<InputSource>(new InputSource());
+    src->owned_ = std::move(data);
+    src->data_ = src->owned_.data();
+    src->size_ = src->owned_.size();
+    return src;
+  }
+
+  // Opens a file path, or standard input when path is "-".
+  static std::shared_ptr<InputSource> Open(const std::string& path) {
+#ifndef _WIN32
+    if (path == "-") return FromFd(STDIN_FILENO, false);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Failed to open file: " + path);
+    if (std::unique_ptr<MappedFile> mapped = MappedFile::FromFd(fd)) {
+      ::close(fd);
+      auto src = std::shared_ptr<InputSource>(new InputSource());
+      src->data_ = mapped->data();
+      src->size_ = mapped->size();
+      src->mapped_ = std::move(mapped);
+      return src;
+    }
+    return FromFd(fd, true);
+#else
+    if (path == "-") {
+      std::ostringstream ss;
+      ss << std::cin.rdbuf();
+      return FromString(ss.str());
+    }
+    std::string data;
+    if (!ReadWholeFile(path, data)) throw std::runtime_error("Failed to open file: " + path);
+    return FromString(std::move(data));
+#endif
+  }
+
+  ~InputSource() {
+#ifndef _WIN32
+    if (fd_ >= 0 && owns_fd_) ::close(fd_);
+#endif
+  }
+
+  InputSource(const InputSource&) = delete;
+  InputSource& operator=(const InputSource&) = delete;
+
+  // Total size in bytes, or nullopt for streams of unknown length.
+  std::optional<std::size_t> Size() const {
+    if (IsStream()) return std::nullopt;
+    return size_;
+  }
+
+  // Reads up to n bytes; returns an empty string at end of input.
+  std::string Read(std::size_t n) {
+    if (!IsStream()) {
+      std::size_t count = std::min(n, size_ - pos_);
+      std::string out(data_ + pos_, count);
+      pos_ += count;
+      return out;
+    }
+    std::string out;
+    while (out.size() < n && Fill()) {
+      std::size_t count = std::min(n - out.size(), buf_end_ - buf_pos_);
+      out.append(buf_.data() + buf_pos_, count);
+      buf_pos_ += count;
+    }
+    return out;
+  }
+
+  // Reads the next line without its trailing newline; returns false at end of input.
+  bool ReadLine(std::string& line) {
+    line.clear();
+    if (!IsStream()) {
+      if (pos_ >= size_) return false;
+      const void* nl = std::memchr(data_ + pos_, '\n', size_ - pos_);
+      std::size_t end = nl ? static_cast<std::size_t>(static_cast<const char*>(nl) - data_) : size_;
+      line.assign(data_ + pos_, end - pos_);
+      pos_ = nl ? end + 1 : end;
+      return true;
+    }
+    bool any = false;
+    while (Fill()) {
+      any = true;
+      const char* start = buf_.data() + buf_pos_;
+      const void* nl = std::memchr(start, '\n', buf_end_ - buf_pos_);
+      if (nl) {
+        std::size_t count = static_cast<std::size_t>(static_cast<const char*>(nl) - start);
+        line.append(start, count);
+        buf_pos_ += count + 1;
+        return true;
+      }
+      line.append(start, buf_end_ - buf_pos_);
+      buf_pos_ = buf_end_;
+    }
+    return any;
+  }
+
+#ifndef _WIN32
+  // Streams from an already open descriptor (a pipe or socket), closing it on destruction if owns is set.
+  static std::shared_ptr<InputSource> FromFd(int fd, bool owns) {
+    auto src = std::shared_ptr<InputSource>(new InputSource());
+    src->fd_ = fd;
+    src->owns_fd_ = owns;
+    src->buf_.resize(kStreamBufferSize);
+    return src;
+  }
+#endif
+
+  // Reads everything that has not been consumed yet.
+  std::string ReadRest() {
+    if (!IsStream()) return Read(size_ - pos_);
+    std::string out;
+    while (Fill()) {
+      out.append(buf_.data() + buf_pos_, buf_end_ - buf_pos_);
+      buf_pos_ = buf_end_;
+    }
+    return out;
+  }
+
+ private:
+  InputSource() = default;
+
+  bool IsStream() const { return fd_ >= 0; }
+
+  // Ensures the stream buffer has unread bytes; returns false at end of input.
+  bool Fill() {
+    if (buf_pos_ < buf_end_) return true;
+    if (eof_) return false;
+#ifndef _WIN32
+    while (true) {
+      ssize_t n = ::read(fd_, buf_.data(), buf_.size());
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        eof_ = true;
+        return false;
+      }
+      buf_pos_ = 0;
+      buf_end_ = static_cast<std::size_t>(n);
+      return true;
+    }
+#else
+    eof_ = true;
+    return false;
+#endif
+  }
+
+  // Memory-backed input (mapped file or owned string).
+  std::string owned_;
+  std::unique_ptr<MappedFile> mapped_;
+  const char* data_ = nullptr;
+  std::size_t size_ = 0;
+  std::size_t pos_ = 0;
+
+  // Stream-backed input (pipe or terminal).
+  int fd_ = -1;
+  bool owns_fd_ = false;
+  bool eof_ = false;
+  std::vector<char> buf_;
+  std::size_t buf_pos_ = 0;
+  std::size_t buf_end_ = 0;
+};
+
+// Parses a CSV field as a number if it is written in plain decimal notation
+// ([+-]digits[.digits][e[+-]digits]) and is finite. strtod alone would also take hex,
+// "inf" and "nan", which in a data file are text.
+static bool ParseCsvNumber(const std::string& f, double& x) {
+  std::size_t i = 0, n = f.size();
+  auto digits = [&]() {
+    std::size_t start = i;
+    while (i < n && std::isdigit(static_cast<unsigned char>(f[i]))) i++;
+    return i - start;
+  };
+  if (i < n && (f[i] == '+' || f[i] == '-')) i++;
+  std::size_t mantissa = digits();
+  if (i < n && f[i] == '.') {
+    i++;
+    mantissa += digits();
+  }
+  if (mantissa == 0) return false;
+  if (i < n && (f[i] == 'e' || f[i] == 'E')) {
+    i++;
+    if (i < n && (f[i] == '+' || f[i] == '-')) i++;
+    if (digits() == 0) return false;
+  }
+  if (i != n) return false;
+  x = std::strtod(f.c_str(), nullptr);
+  return std::isfinite(x);
+}
+
+// Reads RFC 4180 CSV records from an InputSource in large chunks. Quoted fields
+// may contain delimiters, doubled quotes and line breaks; records end at LF or CRLF.
+class CsvReader {
+ public:
+  CsvReader(std::shared_ptr<InputSource> src, char delimiter, char quote)
+      : src_(std::move(src)), delimiter_(delimiter), quote_(quote) {
+    special_.bits[static_cast<unsigned char>(delimiter)] = true;
+    special_.bits[static_cast<unsigned char>(quote)] = true;
+    special_.bits[static_cast<unsigned char>('\n')] = true;
+    special_.bits[static_cast<unsigned char>('\r')] = true;
+  }
+
+  // Reads the next record into fields; returns false at end of input.
+  bool NextRow(std::vector<std::string>& fields) {
+    fields.clear();
+    if (!Available()) return false;
+    std::string field;
+    while (true) {
+      field.clear();
+      bool end_of_record = ReadField(field);
+      fields.push_back(std::move(field));
+      if (end_of_record) return true;
+    }
+  }
+
+ private:
+  // Reads one field; returns true if it was the last field of the record.
+  bool ReadField(std::string& field) {
+    if (Available() && buf_[pos_] == quote_) {
+      pos_++;
+      while (true) {
+        if (!Available()) throw RuntimeError("csv: unterminated quoted field");
+        std::size_t start = pos_;
+        while (pos_ < buf_.size() && buf_[pos_] != quote_) pos_++;
+        field.append(buf_, start, pos_ - start);
+        if (pos_ == buf_.size()) continue;
+        pos_++;
+        if (Available() && buf_[pos_] == quote_) {
+          field.push_back(quote_);
+          pos_++;
+          continue;
+        }
+        break;
+      }
+    }
+    // Unquoted data (or stray bytes after a closing quote) up to the next delimiter or line end.
+    while (true) {
+      if (!Available()) return true;
+      std::size_t start = pos_;
+      while (pos_ < buf_.size() && !special_.Has(buf_[pos_])) pos_++;
+      field.append(buf_, start, pos_ - start);
+      if (pos_ == buf_.size()) continue;
+      char c = buf_[pos_++];
+      if (c == delimiter_) return false;
+      if (c == '\n') return true;
+      if (c == '\r') {
+        if (Available() && buf_[pos_] == '\n') {
+          pos_++;
+          return true;
+        }
+        field.push_back(c);
+        continue;
+      }
+      field.push_back(c);
+    }
+  }
+
+  // Makes sure there is unread data in the buffer; returns false at end of input.
+  bool Available() {
+    if (pos_ < buf_.size()) return true;
+    buf_ = src_->Read(InputSource::kStreamBufferSize);
+    pos_ = 0;
+    return !buf_.empty();
+  }
+
+  std::shared_ptr<InputSource> src_;
+  char delimiter_;
+  char quote_;
+  ByteSet special_;
+  std::string buf_;
+  std::size_t pos_ = 0;
+};
+
+// A bounded multi-producer multi-consumer queue used to pass serialized values
+// between isolates. Senders block while it is full, receivers while it is empty.
+class Channel {
+ public:
+  explicit Channel(std::size_t capacity) : capacity_(capacity == 0 ? 1 : capacity) {}
+
+  // Returns false if the channel is closed. While blocked, poll is called every
+  // kPollInterval; it may throw to give up waiting (e.g. when the script is cancelled).
+  bool Send(std::string message, const std::function<void()>& poll) {
+    std::unique_lock<std::mutex> lock(mu_);
+    Wait(lock, not_full_, [&] { return closed_ || queue_.size() < capacity_; }, poll);
+    if (closed_) return false;
+    queue_.push_back(std::move(message));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Returns false once the channel is closed and drained. poll is called as in Send.
+  bool Recv(std::string& message, const std::function<void()>& poll) {
+    std::unique_lock<std::mutex> lock(mu_);
+    Wait(lock, not_empty_, [&] { return closed_ || !queue_.empty(); }, poll);
+    if (queue_.empty()) return false;
+    message = std::move(queue_.front());
+    queue_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mu_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+ private:
+  static constexpr std::chrono::milliseconds kPollInterval{50};
+
+  template <typename Pred>
+  static void Wait(std::unique_lock<std::mutex>& lock, std::condition_variable& cv, Pred ready,
+                   const std::function<void()>& poll) {
+    while (!cv.wait_for(lock, kPollInterval, ready)) {
+      lock.unlock();
+      poll();
+      lock.lock();
+    }
+  }
+
+  std::size_t capacity_;
+  std::mutex mu_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<std::string> queue_;
+  bool closed_ = false;
+};
+
+// The channels of one script run, shared with its isolates and par_map workers. Channels
+// are referred to by number so they can be passed to isolates like any other value; the
+// numbers mean nothing to other runs, and the channels are freed when the run is reset.
+class ChannelTable {
+ public:
+  int Create(std::size_t capacity) {
+    std::lock_guard<std::mutex> lock(mu_);
+    int id = next_id_++;
+    channels_.emplace(id, std::make_shared<Channel>(capacity));
+    return id;
+  }
+
+  std::shared_ptr<Channel> Find(int id) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = channels_.find(id);
+    return it == channels_.end() ? nullptr : it->second;
+  }
+
+ private:
+  std::mutex mu_;
+  std::unordered_map<int, std::shared_ptr<Channel>> channels_;
+  int next_id_ = 1;
+};
+
+// A stream buffer that collects output locally and hands it to a C stdio stream in
+// large chunks. stdio streams lock internally, so isolates on different threads can
+// share the process's stdout/stderr without racing on std::cout.
+class StdioStreamBuf : public std::streambuf {
+ public:
+  explicit StdioStreamBuf(FILE* file) : file_(file), buffer_(1 << 16) { setp(buffer_.data(), buffer_.data() + buffer_.size()); }
+  ~StdioStreamBuf() override { sync(); }
+
+ protected:
+  int_type overflow(int_type ch) override {
+    if (sync() != 0) return traits_type::eof();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  int sync() override {
+    std::size_t n = static_cast<std::size_t>(pptr() - pbase());
+    if (n > 0 && std::fwrite(pbase(), 1, n, file_) != n) return -1;
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    return std::fflush(file_) == 0 ? 0 : -1;
+  }
+
+ private:
+  FILE* file_;
+  std::vector<char> buffer_;
+};
+
+// The set of runtime kinds a value may have, as worked out by InferTypes.
+using TypeSet = unsigned;
+static constexpr TypeSet kTypeNil = 1u << 0;
+static constexpr TypeSet kTypeBool = 1u << 1;
+static constexpr TypeSet kTypeNumber = 1u << 2;
+static constexpr TypeSet kTypeString = 1u << 3;
+static constexpr TypeSet kTypeFunction = 1u << 4;
+static constexpr TypeSet kTypeOther = 1u << 5;
+static constexpr TypeSet kTypeAny = (1u << 6) - 1;
+
+static std::string TypeSetName(TypeSet t) {
+  if (t == kTypeAny) return "any";
+  static const char* const kNames[] = {"nil", "bool", "number", "string", "function", "other"};
+  std::string out;
+  for (int i = 0; i < 6; i++) {
+    if (!(t & (1u << i))) continue;
+    if (!out.empty()) out += "|";
+    out += kNames[i];
+  }
+  return out.empty() ? "none" : out;
+}
+
+// One variable binding, assignment or read, as reported by --dump-types.
+struct TypeRecord {
+  SourceLocation loc;
+  std::string kind;  // let, param, fun, assign or read
+  std::string name;
+  TypeSet type = kTypeAny;
+};
+
+// Flow-sensitive type inference over a parsed program. Each function body (and the top
+// level) is analysed on its own: parameters and variables from enclosing scopes are `any`,
+// branches are joined and loops are iterated to a fixed point. Variables that a nested
+// function assigns are `any` throughout, since any call may change them.
+//
+// The result is recorded in the AST: UnaryExpr::numeric and BinaryExpr::numeric mark
+// operators whose operands are always numbers, which the interpreter evaluates on raw
+// doubles. Code in other modules is not visible here (a module may assign a global of the
+// script), so the interpreter still checks each variable it reads that way and falls back
+// to ordinary evaluation if the value is not a number.
+class TypeInference {
+ public:
+  explicit TypeInference(std::vector<TypeRecord>* records = nullptr) : records_(records) {}
+
+  void Run(const std::vector<StmtPtr>& program) {
+    AnalyzeFunction(program, nullptr, true);
+    if (!records_) return;
+    for (auto& r : recorded_) records_->push_back(std::move(r.second));
+    std::stable_sort(records_->begin(), records_->end(), [](const TypeRecord& a, const TypeRecord& b) {
+      return a.loc.line != b.loc.line ? a.loc.line < b.loc.line : a.loc.column < b.loc.column;
+    });
+  }
+
+ private:
+  // Variables are identified by the token that first declared them in their scope, which
+  // stays the same however often a loop body is re-analysed.
+  using VarId = const Token*;
+  // Types of the variables declared on the current path; a variable missing here may not
+  // exist yet, so a read of it could reach a variable of the same name further out.
+  using State = std::unordered_map<VarId, TypeSet>;
+
+  struct Function {
+    std::vector<std::unordered_map<std::string, VarId>> scopes;
+    std::set<std::string> escaping;
+    bool top_level = false;
+  };
+
+  void AnalyzeFunction(const std::vector<StmtPtr>& body, const std::vector<Token>* params, bool topLevel) {
+    Function fn;
+    fn.top_level = topLevel;
+    for (const auto& s : body) CollectNestedAssignments(s.get(), false, fn.escaping);
+    fn.scopes.emplace_back();
+    Function* saved = fn_;
+    State savedState = std::move(state_);
+    fn_ = &fn;
+    state_.clear();
+    if (params) {
+      for (const auto& p : *params) Declare(p, "param", kTypeAny);
+    }
+    for (const auto& s : body) Analyze(s.get());
+    fn_ = saved;
+    state_ = std::move(savedState);
+  }
+
+  // Adds the names assigned inside functions nested in stmt to out.
+  static void CollectNestedAssignments(const Stmt* stmt, bool nested, std::set<std::string>& out) {
+    if (auto s = dynamic_cast<const AssignStmt*>(stmt)) {
+      if (nested) out.insert(s->name.lexeme);
+    } else if (auto s = dynamic_cast<const BlockStmt*>(stmt)) {
+      for (const auto& st : s->statements) CollectNestedAssignments(st.get(), nested, out);
+    } else if (auto s = dynamic_cast<const IfStmt*>(stmt)) {
+      CollectNestedAssignments(s->thenBranch.get(), nested, out);
+      if (s->elseBranch.has_value()) CollectNestedAssignments((*s->elseBranch).get(), nested, out);
+    } else if (auto s = dynamic_cast<const WhileStmt*>(stmt)) {
+      CollectNestedAssignments(s->body.get(), nested, out);
+    } else if (auto s = dynamic_cast<const FunctionStmt*>(stmt)) {
+      for (const auto& st : s->body) CollectNestedAssignments(st.get(), true, out);
+    }
+  }
+
+  void Declare(const Token& name, const char* kind, TypeSet type) {
+    auto& scope = fn_->scopes.back();
+    VarId id = scope.emplace(name.lexeme, &name).first->second;
+    if (fn_->escaping.count(name.lexeme)) type = kTypeAny;
+    state_[id] = type;
+    Record(name, kind, type);
+  }
+
+  VarId Resolve(const std::string& name) const {
+    for (auto it = fn_->scopes.rbegin(); it != fn_->scopes.rend(); ++it) {
+      auto found = it->find(name);
+      if (found != it->end()) return found->second;
+    }
+    return nullptr;
+  }
+
+  TypeSet Lookup(const std::string& name) const {
+    VarId id = Resolve(name);
+    if (!id || fn_->escaping.count(name)) return kTypeAny;
+    auto it = state_.find(id);
+    return it == state_.end() ? kTypeAny : it->second;
+  }
+
+  void Record(const Token& at, const char* kind, TypeSet type) {
+    if (!records_) return;
+    // Loop bodies are analysed more than once; the last pass holds the fixed point.
+    recorded_[&at] = TypeRecord{at.loc, kind, at.lexeme, type};
+  }
+
+  static State Join(const State& a, const State& b) {
+    State out;
+    for (const auto& [id, type] : a) {
+      auto it = b.find(id);
+      out[id] = it == b.end() ? kTypeAny : type | it->second;
+    }
+    for (const auto& [id, type] : b) {
+      if (!a.count(id)) out[id] = kTypeAny;
+    }
+    return out;
+  }
+
+  void AnalyzeBlock(const std::vector<StmtPtr>& statements) {
+    fn_->scopes.emplace_back();
+    for (const auto& s : statements) Analyze(s.get());
+    for (const auto& [name, id] : fn_->scopes.back()) state_.erase(id);
+    fn_->scopes.pop_back();
+  }
+
+  void Analyze(const Stmt* stmt) {
+    if (auto s = dynamic_cast<const LetStmt*>(stmt)) {
+      TypeSet t = Infer(s->init.get());
+      Declare(s->name, "let", t);
+    } else if (auto s = dynamic_cast<const AssignStmt*>(stmt)) {
+      TypeSet t = Infer(s->value.get());
+      VarId id = Resolve(s->name.lexeme);
+      if (fn_->escaping.count(s->name.lexeme)) t = kTypeAny;
+      if (id) state_[id] = t;
+      Record(s->name, "assign", t);
+    } else if (auto s = dynamic_cast<const PrintStmt*>(stmt)) {
+      Infer(s->expr.get());
+    } else if (auto s = dynamic_cast<const ExprStmt*>(stmt)) {
+      Infer(s->expr.get());
+    } else if (dynamic_cast<const ImportStmt*>(stmt)) {
+      // A module runs in the global scope and may redefine any global.
+      if (fn_->top_level) {
+        for (const auto& entry : fn_->scopes.front()) state_[entry.second] = kTypeAny;
+      }
+    } else if (auto s = dynamic_cast<const BlockStmt*>(stmt)) {
+      AnalyzeBlock(s->statements);
+    } else if (auto s = dynamic_cast<const IfStmt*>(stmt)) {
+      Infer(s->condition.get());
+      State before = state_;
+      Analyze(s->thenBranch.get());
+      State afterThen = std::move(state_);
+      state_ = std::move(before);
+      if (s->elseBranch.has_value()) Analyze((*s->elseBranch).get());
+      state_ = Join(afterThen, state_);
+    } else if (auto s = dynamic_cast<const WhileStmt*>(stmt)) {
+      // The lattice is finite and Join only widens, so this terminates.
+      for (;;) {
+        State head = state_;
+        Infer(s->condition.get());
+        Analyze(s->body.get());
+        state_ = Join(head, state_);
+        if (state_ == head) break;
+      }
+    } else if (auto s = dynamic_cast<const FunctionStmt*>(stmt)) {
+      Declare(s->name, "fun", kTypeFunction);
+      AnalyzeFunction(s->body, &s->params, false);
+    } else if (auto s = dynamic_cast<const ReturnStmt*>(stmt)) {
+      if (s->value.has_value()) Infer((*s->value).get());
+    } else if (auto s = dynamic_cast<const YieldStmt*>(stmt)) {
+      if (s->value.has_value()) Infer((*s->value).get());
+    }
+  }
+
+  TypeSet Infer(Expr* expr) {
+    if (auto e = dynamic_cast<const LiteralExpr*>(expr)) {
+      switch (e->kind) {
+        case LiteralExpr::Kind::Number: return kTypeNumber;
+        case LiteralExpr::Kind::String: return kTypeString;
+        case LiteralExpr::Kind::Bool: return kTypeBool;
+        case LiteralExpr::Kind::Nil: return kTypeNil;
+      }
+    }
+    if (auto e = dynamic_cast<const VariableExpr*>(expr)) {
+      TypeSet t = Lookup(e->name.lexeme);
+      Record(e->name, "read", t);
+      return t;
+    }
+    if (auto e = dynamic_cast<const GroupingExpr*>(expr)) return Infer(e->expr.get());
+    if (auto e = dynamic_cast<UnaryExpr*>(expr)) {
+      TypeSet right = Infer(e->right.get());
+      e->numeric = right == kTypeNumber;
+      return e->op.type == TokenType::Minus ? kTypeNumber : kTypeBool;
+    }
+    if (auto e = dynamic_cast<const LogicalExpr*>(expr)) {
+      TypeSet left = Infer(e->left.get());
+      return left | Infer(e->right.get());
+    }
+    if (auto e = dynamic_cast<BinaryExpr*>(expr)) {
+      TypeSet left = Infer(e->left.get());
+      TypeSet right = Infer(e->right.get());
+      e->numeric = left == kTypeNumber && right == kTypeNumber;
+      switch (e->op.type) {
+        case TokenType::Plus:
+          if (e->numeric) return kTypeNumber;
+          if (left == kTypeString && right == kTypeString) return kTypeString;
+          return kTypeNumber | kTypeString;
+        case TokenType::Star: return (left & kTypeString) ? kTypeNumber | kTypeString : kTypeNumber;
+        case TokenType::Minus:
+        case TokenType::Slash: return kTypeNumber;
+        default: return kTypeBool;
+      }
+    }
+    if (auto e = dynamic_cast<const CallExpr*>(expr)) {
+      Infer(e->callee.get());
+      for (const auto& a : e->args) Infer(a.get());
+    }
+    return kTypeAny;
+  }
+
+  std::vector<TypeRecord>* records_;
+  std::unordered_map<const Token*, TypeRecord> recorded_;
+  Function* fn_ = nullptr;
+  State state_;
+};
+
+// Runs type inference over program, marking the operators it can evaluate on raw numbers.
+static void InferTypes(const std::vector<StmtPtr>& program, std::vector<TypeRecord>* records = nullptr) {
+  TypeInference(records).Run(program);
+}
+
+// Lexes and parses a program, reporting errors to err. Returns false on error.
+static bool CompileSource(const std::string& source, std::vector<StmtPtr>& program, std::ostream& err) {
+  Lexer lexer(source);
+  std::vector<Token> tokens = lexer.LexAll();
+  for (const auto& t : tokens) {
+    if (t.type == TokenType::Invalid) {
+      err << "Lex error at " << t.loc.line << ":" << t.loc.column << ": " << t.lexeme << "\n";
+      return false;
+    }
+  }
+  try {
+    Parser parser(std::move(tokens));
+    program = parser.ParseProgram();
+    InferTypes(program);
+    return true;
+  } catch (const ParseError& e) {
+    err << e.what() << "\n";
+    return false;
+  }
+}
+
+// Hands out index ranges of [0, count) to a fixed set of workers. Each worker starts with
+// a contiguous slice and takes grain-sized chunks from its front; once its slice is empty
+// it steals the back half of another worker's remaining slice.
+class WorkStealingRanges {
+ public:
+  WorkStealingRanges(std::size_t count, std::size_t workers, std::size_t grain) : grain_(grain == 0 ? 1 : grain) {
+    for (std::size_t w = 0; w < workers; w++) {
+      auto r = std::make_unique<Range>();
+      r->begin = count * w / workers;
+      r->end = count * (w + 1) / workers;
+      ranges_.push_back(std::move(r));
+    }
+  }
+
+  // Returns false once no work is left anywhere.
+  bool Next(std::size_t worker, std::size_t& begin, std::size_t& end) {
+    if (Take(*ranges_[worker], begin, end)) return true;
+    for (std::size_t i = 1; i < ranges_.size(); i++) {
+      Range& victim = *ranges_[(worker + i) % ranges_.size()];
+      std::size_t stolen_begin, stolen_end;
+      {
+        std::lock_guard<std::mutex> lock(victim.mu);
+        if (victim.begin >= victim.end) continue;
+        stolen_begin = victim.begin + (victim.end - victim.begin) / 2;
+        stolen_end = victim.end;
+        victim.end = stolen_begin;
+      }
+      if (stolen_begin == stolen_end) continue;
+      begin = stolen_begin;
+      end = std::min(stolen_end, stolen_begin + grain_);
+      Range& own = *ranges_[worker];
+      std::lock_guard<std::mutex> lock(own.mu);
+      own.begin = end;
+      own.end = stolen_end;
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  struct Range {
+    std::mutex mu;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+  };
+
+  bool Take(Range& r, std::size_t& begin, std::size_t& end) {
+    std::lock_guard<std::mutex> lock(r.mu);
+    if (r.begin >= r.end) return false;
+    begin = r.begin;
+    end = std::min(r.end, r.begin + grain_);
+    r.begin = end;
+    return true;
+  }
+
+  std::size_t grain_;
+  std::vector<std::unique_ptr<Range>> ranges_;
+};
+
+// A parsed script. It is immutable once compiled, so one instance can be shared by any
+// number of interpreters and threads.
+class CompiledProgram {
+ public:
+  // Returns nullptr and reports the error to err if the source does not lex or parse.
+  static std::shared_ptr<const CompiledProgram> Compile(const std::string& source, std::ostream& err) {
+    auto program = std::shared_ptr<CompiledProgram>(new CompiledProgram());
+    if (!CompileSource(source, program->statements_, err)) return nullptr;
+    return program;
+  }
+
+  // Takes ownership of statements that were parsed or decoded elsewhere.
+  static std::shared_ptr<const CompiledProgram> FromStatements(std::vector<StmtPtr> statements) {
+    auto program = std::shared_ptr<CompiledProgram>(new CompiledProgram());
+    program->statements_ = std::move(statements);
+    InferTypes(program->statements_);
+    return program;
+  }
+
+  const std::vector<StmtPtr>& statements() const { return statements_; }
+
+ private:
+  CompiledProgram() = default;
+
+  std::vector<StmtPtr> statements_;
+};
+
+// Tags of the binary AST format stored in snapshots.
+enum class AstTag : unsigned char {
+  Literal,
+  Variable,
+  Grouping,
+  Unary,
+  Binary,
+  Logical,
+  Call,
+  Let,
+  Assign,
+  Print,
+  Expr,
+  Import,
+  Block,
+  If,
+  While,
+  Function,
+  Return,
+  Yield,
+};
+
+// Far deeper than real programs nest (a chain of 8192 binary operators), but shallow
+// enough that a corrupt image cannot recurse AstReader off the end of the stack.
+// AstWriter refuses the same trees, so every image it writes can be read back.
+static constexpr int kMaxAstDepth = 8192;
+
+// Counts one level of AstWriter/AstReader recursion for as long as it lives, calling
+// fail once the depth passes kMaxAstDepth.
+struct AstNesting {
+  AstNesting(int& depth, void (*fail)()) : depth_(depth) {
+    if (++depth_ > kMaxAstDepth) fail();
+  }
+  ~AstNesting() { --depth_; }
+  int& depth_;
+};
+
+// Encodes parsed statements in a compact binary form that AstReader turns back into
+// the same tree without lexing or parsing.
+class AstWriter {
+ public:
+  explicit AstWriter(std::string& out) : out_(out) {}
+
+  void WriteStmts(const std::vector<StmtPtr>& stmts) {
+    PutVarint(stmts.size());
+    for (const auto& s : stmts) WriteStmt(s.get());
+  }
+
+  void PutVarint(std::uint64_t x) {
+    while (x >= 0x80) {
+      out_.push_back(static_cast<char>((x & 0x7F) | 0x80));
+      x >>= 7;
+    }
+    out_.push_back(static_cast<char>(x));
+  }
+
+  void PutString(const std::string& s) {
+    PutVarint(s.size());
+    out_ += s;
+  }
+
+ private:
+  void Put(AstTag t) { out_.push_back(static_cast<char>(t)); }
+
+  void WriteToken(const Token& t) {
+    PutVarint(static_cast<std::uint64_t>(t.type));
+    PutString(t.lexeme);
+    PutVarint(static_cast<std::uint64_t>(t.loc.line));
+    PutVarint(static_cast<std::uint64_t>(t.loc.column));
+  }
+
+  void WriteOptional(const std::optional<ExprPtr>& e) {
+    out_.push_back(e.has_value() ? 1 : 0);
+    if (e.has_value()) WriteExpr(e->get());
+  }
+
+  [[noreturn]] static void TooDeep() {
+    throw RuntimeError("Program nested too deeply to store (more than " + std::to_string(kMaxAstDepth) + " levels)");
+  }
+
+  void WriteExpr(const Expr* expr) {
+    AstNesting nesting(depth_, TooDeep);
+    if (auto e = dynamic_cast<const LiteralExpr*>(expr)) {
+      Put(AstTag::Literal);
+      out_.push_back(static_cast<char>(e->kind));
+      PutString(e->value);
+    } else if (auto e = dynamic_cast<const VariableExpr*>(expr)) {
+      Put(AstTag::Variable);
+      WriteToken(e->name);
+    } else if (auto e = dynamic_cast<const GroupingExpr*>(expr)) {
+      Put(AstTag::Grouping);
+      WriteExpr(e->expr.get());
+    } else if (auto e = dynamic_cast<const UnaryExpr*>(expr)) {
+      Put(AstTag::Unary);
+      WriteToken(e->op);
+      WriteExpr(e->right.get());
+    } else if (auto e = dynamic_cast<const BinaryExpr*>(expr)) {
+      Put(AstTag::Binary);
+      WriteExpr(e->left.get());
+      WriteToken(e->op);
+      WriteExpr(e->right.get());
+    } else if (auto e = dynamic_cast<const LogicalExpr*>(expr)) {
+      Put(AstTag::Logical);
+      WriteExpr(e->left.get());
+      WriteToken(e->op);
+      WriteExpr(e->right.get());
+    } else if (auto e = dynamic_cast<const CallExpr*>(expr)) {
+      Put(AstTag::Call);
+      WriteExpr(e->callee.get());
+      WriteToken(e->paren);
+      PutVarint(e->args.size());
+      for (const auto& a : e->args) WriteExpr(a.get());
+    } else {
+      throw RuntimeError("Unknown expression");
+    }
+  }
+
+  void WriteStmt(const Stmt* stmt) {
+    AstNesting nesting(depth_, TooDeep);
+    if (auto s = dynamic_cast<const LetStmt*>(stmt)) {
+      Put(AstTag::Let);
+      WriteToken(s->name);
+      WriteExpr(s->init.get());
+    } else if (auto s = dynamic_cast<const AssignStmt*>(stmt)) {
+      Put(AstTag::Assign);
+      WriteToken(s->name);
+      WriteExpr(s->value.get());
+    } else if (auto s = dynamic_cast<const PrintStmt*>(stmt)) {
+      Put(AstTag::Print);
+      WriteExpr(s->expr.get());
+    } else if (auto s = dynamic_cast<const ExprStmt*>(stmt)) {
+      Put(AstTag::Expr);
+      WriteExpr(s->expr.get());
+    } else if (auto s = dynamic_cast<const ImportStmt*>(stmt)) {
+      Put(AstTag::Import);
+      WriteToken(s->module);
+    } else if (auto s = dynamic_cast<const BlockStmt*>(stmt)) {
+      Put(AstTag::Block);
+      WriteStmts(s->statements);
+    } else if (auto s = dynamic_cast<const IfStmt*>(stmt)) {
+      Put(AstTag::If);
+      WriteExpr(s->condition.get());
+      WriteStmt(s->thenBranch.get());
+      out_.push_back(s->elseBranch.has_value() ? 1 : 0);
+      if (s->elseBranch.has_value()) WriteStmt(s->elseBranch->get());
+    } else if (auto s = dynamic_cast<const WhileStmt*>(stmt)) {
+      Put(AstTag::While);
+      WriteExpr(s->condition.get());
+      WriteStmt(s->body.get());
+    } else if (auto s = dynamic_cast<const FunctionStmt*>(stmt)) {
+      Put(AstTag::Function);
+      WriteToken(s->name);
+      PutVarint(s->params.size());
+      for (const auto& p : s->params) WriteToken(p);
+      WriteStmts(s->body);
+      out_.push_back(s->is_generator ? 1 : 0);
+    } else if (auto s = dynamic_cast<const ReturnStmt*>(stmt)) {
+      Put(AstTag::Return);
+      WriteToken(s->keyword);
+      WriteOptional(s->value);
+    } else if (auto s = dynamic_cast<const YieldStmt*>(stmt)) {
+      Put(AstTag::Yield);
+      WriteToken(s->keyword);
+      WriteOptional(s->value);
+    } else {
+      throw RuntimeError("Unknown statement");
+    }
+  }
+
+  std::string& out_;
+  int depth_ = 0;
+};
+
+// Rebuilds statements written by AstWriter from a byte range (e.g. a mapped file).
+class AstReader {
+ public:
+  AstReader(const char* p, const char* end) : p_(p), end_(end) {}
+
+  std::vector<StmtPtr> ReadStmts() {
+    std::uint64_t n = GetVarint();
+    if (n > static_cast<std::uint64_t>(end_ - p_)) Corrupt();
+    std::vector<StmtPtr> stmts;
+    stmts.reserve(static_cast<std::size_t>(n));
+    for (std::uint64_t i = 0; i < n; i++) stmts.push_back(ReadStmt());
+    return stmts;
+  }
+
+  std::uint64_t GetVarint() {
+    std::uint64_t x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p_ == end_) Corrupt();
+      auto b = static_cast<unsigned char>(*p_++);
+      x |= static_cast<std::uint64_t>(b & 0x7F) << shift;
+      if (!(b & 0x80)) return x;
+    }
+    Corrupt();
+  }
+
+  std::string GetString() {
+    std::uint64_t n = GetVarint();
+    if (n > static_cast<std::uint64_t>(end_ - p_)) Corrupt();
+    std::string s(p_, static_cast<std::size_t>(n));
+    p_ += n;
+    return s;
+  }
+
+  // Returns the next n bytes without copying them.
+  const char* GetBytes(std::uint64_t n) {
+    if (n > static_cast<std::uint64_t>(end_ - p_)) Corrupt();
+    const char* p = p_;
+    p_ += n;
+    return p;
+  }
+
+  unsigned char GetByte() {
+    if (p_ == end_) Corrupt();
+    return static_cast<unsigned char>(*p_++);
+  }
+
+  bool AtEnd() const { return p_ == end_; }
+
+  [[noreturn]] static void Corrupt() { throw RuntimeError("Corrupt snapshot"); }
+
+ private:
+  Token ReadToken() {
+    Token t;
+    std::uint64_t type = GetVarint();
+    if (type > static_cast<std::uint64_t>(TokenType::Invalid)) Corrupt();
+    t.type = static_cast<TokenType>(type);
+    t.lexeme = GetString();
+    t.loc.line = static_cast<int>(GetVarint());
+    t.loc.column = static_cast<int>(GetVarint());
+    return t;
+  }
+
+  std::optional<ExprPtr> ReadOptional() {
+    if (GetByte() == 0) return std::nullopt;
+    return ReadExpr();
+  }
+
+  ExprPtr ReadExpr() {
+    AstNesting nesting(depth_, Corrupt);
+    auto tag = static_cast<AstTag>(GetByte());
+    switch (tag) {
+      case AstTag::Literal: {
+        unsigned char kind = GetByte();
+        if (kind > static_cast<unsigned char>(LiteralExpr::Kind::Nil)) Corrupt();
+        return std::make_unique<LiteralExpr>(static_cast<LiteralExpr::Kind>(kind), GetString());
+      }
+      case AstTag::Variable: return std::make_unique<VariableExpr>(ReadToken());
+      case AstTag::Grouping: return std::make_unique<GroupingExpr>(ReadExpr());
+      case AstTag::Unary: {
+        Token op = ReadToken();
+        return std::make_unique<UnaryExpr>(std::move(op), ReadExpr());
+      }
+      case AstTag::Binary:
+      case AstTag::Logical: {
+        ExprPtr left = ReadExpr();
+        Token op = ReadToken();
+        ExprPtr right = ReadExpr();
+        if (tag == AstTag::Logical) return std::make_unique<LogicalExpr>(std::move(left), std::move(op), std::move(right));
+        return std::make_unique<BinaryExpr>(std::move(left), std::move(op), std::move(right));
+      }
+      case AstTag::Call: {
+        ExprPtr callee = ReadExpr();
+        Token paren = ReadToken();
+        std::uint64_t n = GetVarint();
+        if (n > static_cast<std::uint64_t>(end_ - p_)) Corrupt();
+        std::vector<ExprPtr> args;
+        args.reserve(static_cast<std::size_t>(n));
+        for (std::uint64_t i = 0; i < n; i++) args.push_back(ReadExpr());
+        return std::make_unique<CallExpr>(std::move(callee), std::move(paren), std::move(args));
+      }
+      default: Corrupt();
+    }
+  }
+
+  StmtPtr ReadStmt() {
+    AstNesting nesting(depth_, Corrupt);
+    switch (static_cast<AstTag>(GetByte())) {
+      case AstTag::Let: {
+        Token name = ReadToken();
+        return std::make_unique<LetStmt>(std::move(name), ReadExpr());
+      }
+      case AstTag::Assign: {
+        Token name = ReadToken();
+        return std::make_unique<AssignStmt>(std::move(name), ReadExpr());
+      }
+      case AstTag::Print: return std::make_unique<PrintStmt>(ReadExpr());
+      case AstTag::Expr: return std::make_unique<ExprStmt>(ReadExpr());
+      case AstTag::Import: return std::make_unique<ImportStmt>(ReadToken());
+      case AstTag::Block: return std::make_unique<BlockStmt>(ReadStmts());
+      case AstTag::If: {
+        ExprPtr condition = ReadExpr();
+        StmtPtr then_branch = ReadStmt();
+        std::optional<StmtPtr> else_branch;
+        if (GetByte() != 0) else_branch = ReadStmt();
+        return std::make_unique<IfStmt>(std::move(condition), std::move(then_branch), std::move(else_branch));
+      }
+      case AstTag::While: {
+        ExprPtr condition = ReadExpr();
+        return std::make_unique<WhileStmt>(std::move(condition), ReadStmt());
+      }
+      case AstTag::Function: {
+        Token name = ReadToken();
+        std::uint64_t n = GetVarint();
+        if (n > static_cast<std::uint64_t>(end_ - p_)) Corrupt();
+        std::vector<Token> params;
+        params.reserve(static_cast<std::size_t>(n));
+        for (std::uint64_t i = 0; i < n; i++) params.push_back(ReadToken());
+        std::vector<StmtPtr> body = ReadStmts();
+        auto fn = std::make_unique<FunctionStmt>(std::move(name), std::move(params), std::move(body));
+        fn->is_generator = GetByte() != 0;
+        return fn;
+      }
+      case AstTag::Return: {
+        Token keyword = ReadToken();
+        return std::make_unique<ReturnStmt>(std::move(keyword), ReadOptional());
+      }
+      case AstTag::Yield: {
+        Token keyword = ReadToken();
+        return std::make_unique<YieldStmt>(std::move(keyword), ReadOptional());
+      }
+      default: Corrupt();
+    }
+  }
+
+  const char* p_;
+  const char* end_;
+  int depth_ = 0;
+};
+
+// A standard library module compiled into the binary as an AstWriter image.
+struct EmbeddedModuleImage {
+  const char* name;
+  const unsigned char* data;
+  std::size_t size;
+};
+
+// potatos_embedded.inc is generated at build time by tools/embed_modules.cpp. Builds
+// without it (e.g. a bare compiler invocation) import every module from disk.
+#if defined(__has_include)
+#if __has_include("potatos_embedded.inc")
+#include "potatos_embedded.inc"
+#define POTATOLANG_HAS_EMBEDDED_MODULES 1
+#endif
+#endif
+#ifndef POTATOLANG_HAS_EMBEDDED_MODULES
+static constexpr EmbeddedModuleImage kEmbeddedModules[] = {{nullptr, nullptr, 0}};
+#endif
+
+// Returns the built-in module called name, or nullptr. Each image is decoded once per
+// process and the resulting AST is shared by every interpreter that imports it.
+static std::shared_ptr<const CompiledProgram> EmbeddedModule(const std::string& name) {
+  for (std::size_t i = 0; kEmbeddedModules[i].name; i++) {
+    const EmbeddedModuleImage& image = kEmbeddedModules[i];
+    if (name != image.name) continue;
+    static std::mutex mu;
+    static std::unordered_map<std::size_t, std::shared_ptr<const CompiledProgram>> decoded;
+    std::lock_guard<std::mutex> lock(mu);
+    auto it = decoded.find(i);
+    if (it == decoded.end()) {
+      const char* data = reinterpret_cast<const char*>(image.data);
+      AstReader r(data, data + image.size);
+      std::vector<StmtPtr> statements = r.ReadStmts();
+      if (!r.AtEnd()) AstReader::Corrupt();
+      it = decoded.emplace(i, CompiledProgram::FromStatements(std::move(statements))).first;
+    }
+    return it->second;
+  }
+  return nullptr;
+}
+
+static constexpr char kSnapshotMagic[] = "PTS2";
+
+// The global state of an interpreter after importing a set of modules: their ASTs and
+// the globals they defined. Written with --make-snapshot and loaded with --snapshot so
+// a run starts with those modules already imported, without reading, lexing, parsing or
+// executing them. Like CompiledProgram, a loaded snapshot is immutable and shareable.
+class Snapshot {
+ public:
+  struct Module {
+    std::string name;
+    std::vector<StmtPtr> statements;
+  };
+
+  struct Global {
+    enum class Kind : unsigned char { Value, Function, Builtin };
+    std::string name;
+    Kind kind = Kind::Value;
+    // Builtin: the builtin's name. Values are stored together, see values().
+    std::string builtin;
+    // Function: a top-level function statement of one of the modules.
+    const FunctionStmt* function = nullptr;
+  };
+
+  // Returns nullptr and reports the error to err if the file is missing or corrupt.
+  static std::shared_ptr<const Snapshot> Load(const std::string& path, std::ostream& err) {
+    auto snapshot = std::shared_ptr<Snapshot>(new Snapshot());
+    snapshot->file_ = MappedFile::Open(path);
+    if (!snapshot->file_) {
+      err << "Failed to open snapshot: " << path << "\n";
+      return nullptr;
+    }
+    const char* data = snapshot->file_->data();
+    std::size_t size = snapshot->file_->size();
+    try {
+      if (size < 4 || std::memcmp(data, kSnapshotMagic, 4) != 0) throw RuntimeError("Not a potato snapshot");
+      AstReader r(data + 4, data + size);
+      std::uint64_t modules = r.GetVarint();
+      for (std::uint64_t i = 0; i < modules; i++) {
+        Module m;
+        m.name = r.GetString();
+        m.statements = r.ReadStmts();
+        InferTypes(m.statements);
+        snapshot->modules_.push_back(std::move(m));
+      }
+      std::uint64_t globals = r.GetVarint();
+      for (std::uint64_t i = 0; i < globals; i++) {
+        Global g;
+        g.name = r.GetString();
+        unsigned char kind = r.GetByte();
+        if (kind > static_cast<unsigned char>(Global::Kind::Builtin)) AstReader::Corrupt();
+        g.kind = static_cast<Global::Kind>(kind);
+        if (g.kind == Global::Kind::Builtin) {
+          g.builtin = r.GetString();
+        } else if (g.kind == Global::Kind::Function) {
+          std::uint64_t module = r.GetVarint();
+          std::uint64_t index = r.GetVarint();
+          if (module >= snapshot->modules_.size()) AstReader::Corrupt();
+          const auto& stmts = snapshot->modules_[static_cast<std::size_t>(module)].statements;
+          if (index >= stmts.size()) AstReader::Corrupt();
+          g.function = dynamic_cast<const FunctionStmt*>(stmts[static_cast<std::size_t>(index)].get());
+          if (!g.function) AstReader::Corrupt();
+        }
+        snapshot->globals_.push_back(std::move(g));
+      }
+      snapshot->values_size_ = static_cast<std::size_t>(r.GetVarint());
+      snapshot->values_data_ = r.GetBytes(snapshot->values_size_);
+      if (!r.AtEnd()) AstReader::Corrupt();
+    } catch (const RuntimeError& e) {
+      err << path << ": " << e.what() << "\n";
+      return nullptr;
+    }
+    return snapshot;
+  }
+
+  const std::vector<Module>& modules() const { return modules_; }
+  const std::vector<Global>& globals() const { return globals_; }
+
+  // Decodes the Value globals, in the order they appear in globals(). They are written as
+  // one list so values that several globals share are still shared after a restore.
+  std::shared_ptr<ListValue> values() const {
+    Value v = ValueReader::Decode(values_data_, values_size_);
+    if (!IsList(v)) AstReader::Corrupt();
+    return std::get<std::shared_ptr<ListValue>>(v.v);
+  }
+
+ private:
+  Snapshot() = default;
+
+  std::unique_ptr<MappedFile> file_;
+  std::vector<Module> modules_;
+  std::vector<Global> globals_;
+  const char* values_data_ = nullptr;
+  std::size_t values_size_ = 0;
+};
+
+#if !defined(_WIN32) && (defined(__x86_64__) || defined(__aarch64__))
+#define POTATOLANG_HAS_COROUTINES 1
+
+// AddressSanitizer has to be told about stack switches or it reports false overflows.
+#if defined(__SANITIZE_ADDRESS__)
+#define POTATOLANG_ASAN_FIBERS 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define POTATOLANG_ASAN_FIBERS 1
+#endif
+#endif
+#ifdef POTATOLANG_ASAN_FIBERS
+extern "C" void __sanitizer_start_switch_fiber(void** fake_stack_save, const void* bottom, std::size_t size);
+extern "C" void __sanitizer_finish_switch_fiber(void* fake_stack_save, const void** bottom_old, std::size_t* size_old);
+#endif
+
+// Saves the callee-saved registers on the current stack, stores the stack pointer in
+// *from, then switches to the stack pointer `to` and restores the registers saved there.
+__attribute__((naked, noinline)) static void SwitchStack(void** /*from*/, void* /*to*/) {
+#if defined(__x86_64__)
+  asm volatile(
+      "pushq %rbp\n\tpushq %rbx\n\tpushq %r12\n\tpushq %r13\n\tpushq %r14\n\tpushq %r15\n\t"
+      "movq %rsp, (%rdi)\n\tmovq %rsi, %rsp\n\t"
+      "popq %r15\n\tpopq %r14\n\tpopq %r13\n\tpopq %r12\n\tpopq %rbx\n\tpopq %rbp\n\tret\n\t");
+#else
+  asm volatile(
+      "sub sp, sp, #160\n\t"
+      "stp x19, x20, [sp, #0]\n\tstp x21, x22, [sp, #16]\n\tstp x23, x24, [sp, #32]\n\t"
+      "stp x25, x26, [sp, #48]\n\tstp x27, x28, [sp, #64]\n\tstp x29, x30, [sp, #80]\n\t"
+      "stp d8, d9, [sp, #96]\n\tstp d10, d11, [sp, #112]\n\tstp d12, d13, [sp, #128]\n\tstp d14, d15, [sp, #144]\n\t"
+      "mov x9, sp\n\tstr x9, [x0]\n\tmov sp, x1\n\t"
+      "ldp x19, x20, [sp, #0]\n\tldp x21, x22, [sp, #16]\n\tldp x23, x24, [sp, #32]\n\t"
+      "ldp x25, x26, [sp, #48]\n\tldp x27, x28, [sp, #64]\n\tldp x29, x30, [sp, #80]\n\t"
+      "ldp d8, d9, [sp, #96]\n\tldp d10, d11, [sp, #112]\n\tldp d12, d13, [sp, #128]\n\tldp d14, d15, [sp, #144]\n\t"
+      "add sp, sp, #160\n\tret\n\t");
+#endif
+}
+
+// First code run on a new coroutine stack: calls the entry function stored in a
+// callee-saved register with the coroutine stored in another.
+__attribute__((naked, noinline)) static void CoroutineTrampoline() {
+#if defined(__x86_64__)
+  asm volatile("movq %rbx, %rdi\n\tcallq *%r12\n\tud2\n\t");
+#else
+  asm volatile("mov x0, x19\n\tblr x20\n\tbrk #0\n\t");
+#endif
+}
+
+// A stackful coroutine on its own mmap'd stack (with a guard page below it). Resume and
+// Yield are a direct register save/restore, so switching costs nanoseconds.
+class Coroutine {
+ public:
+  // As large as a typical main thread stack, so recursion inside a generator goes about as
+  // deep as outside one. Pages are only committed as they are touched.
+  static constexpr std::size_t kStackSize = 8 << 20;
+  // Calls stop (with a RuntimeError, see StackLow) once less than this is left, which
+  // leaves room for builtins that recurse themselves, such as the JSON parser.
+  static constexpr std::size_t kStackReserve = 256 << 10;
+
+  explicit Coroutine(std::function<void()> body) : body_(std::move(body)) {
+    stack_ = AllocateStack();
+    auto* top = reinterpret_cast<void**>(static_cast<char*>(stack_) + kStackSize);
+#if defined(__x86_64__)
+    // Popped by SwitchStack as r15, r14, r13, r12, rbx, rbp, then the return address.
+    void** sp = top - 9;
+    sp[3] = reinterpret_cast<void*>(&Coroutine::Entry);
+    sp[4] = this;
+    sp[5] = nullptr;
+    sp[6] = reinterpret_cast<void*>(&CoroutineTrampoline);
+#else
+    // Loaded by SwitchStack as x19..x28, x29, x30 (the return address), then d8..d15.
+    void** sp = top - 20;
+    sp[0] = this;
+    sp[1] = reinterpret_cast<void*>(&Coroutine::Entry);
+    sp[10] = nullptr;
+    sp[11] = reinterpret_cast<void*>(&CoroutineTrampoline);
+#endif
+    sp_ = sp;
+  }
+
+  ~Coroutine() { ReleaseStack(stack_); }
+
+  Coroutine(const Coroutine&) = delete;
+  Coroutine& operator=(const Coroutine&) = delete;
+
+  // Runs the body until it yields or finishes. Exceptions escaping the body are rethrown here.
+  void Resume() {
+    started_ = true;
+#ifdef POTATOLANG_ASAN_FIBERS
+    void* fake_stack = nullptr;
+    __sanitizer_start_switch_fiber(&fake_stack, stack_, kStackSize);
+    SwitchStack(&caller_sp_, sp_);
+    __sanitizer_finish_switch_fiber(fake_stack, nullptr, nullptr);
+#else
+    SwitchStack(&caller_sp_, sp_);
+#endif
+    if (error_) {
+      std::exception_ptr e = std::move(error_);
+      error_ = nullptr;
+      std::rethrow_exception(e);
+    }
+  }
+
+  // Called from inside the body: returns control to the last Resume.
+  void Yield() {
+#ifdef POTATOLANG_ASAN_FIBERS
+    void* fake_stack = nullptr;
+    __sanitizer_start_switch_fiber(&fake_stack, caller_stack_, caller_stack_size_);
+    SwitchStack(&sp_, caller_sp_);
+    __sanitizer_finish_switch_fiber(fake_stack, &caller_stack_, &caller_stack_size_);
+#else
+    SwitchStack(&sp_, caller_sp_);
+#endif
+  }
+
+  bool started() const { return started_; }
+  bool finished() const { return finished_; }
+
+  // True when the calling frame, which must be running on this coroutine, is within
+  // kStackReserve of the guard page.
+  bool StackLow() const {
+    return static_cast<char*>(__builtin_frame_address(0)) < static_cast<char*>(stack_) + kStackReserve;
+  }
+
+ private:
+  static void Entry(Coroutine* self) {
+#ifdef POTATOLANG_ASAN_FIBERS
+    __sanitizer_finish_switch_fiber(nullptr, &self->caller_stack_, &self->caller_stack_size_);
+#endif
+    try {
+      self->body_();
+    } catch (...) {
+      self->error_ = std::current_exception();
+    }
+    self->finished_ = true;
+#ifdef POTATOLANG_ASAN_FIBERS
+    __sanitizer_start_switch_fiber(nullptr, self->caller_stack_, self->caller_stack_size_);
+#endif
+    SwitchStack(&self->sp_, self->caller_sp_);
+  }
+
+  // Finished stacks are kept for reuse, since generators are often short-lived.
+  static std::mutex& StackMutex() {
+    static std::mutex mu;
+    return mu;
+  }
+
+  static std::vector<void*>& FreeStacks() {
+    static std::vector<void*> stacks;
+    return stacks;
+  }
+
+  static std::size_t PageSize() { return static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)); }
+
+  static void* AllocateStack() {
+    {
+      std::lock_guard<std::mutex> lock(StackMutex());
+      if (!FreeStacks().empty()) {
+        void* stack = FreeStacks().back();
+        FreeStacks().pop_back();
+        return stack;
+      }
+    }
+    std::size_t guard = PageSize();
+    void* base =
+        ::mmap(nullptr, kStackSize + guard, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) throw RuntimeError("Failed to allocate generator stack");
+    ::mprotect(base, guard, PROT_NONE);
+    return static_cast<char*>(base) + guard;
+  }
+
+  static void ReleaseStack(void* stack) {
+    {
+      std::lock_guard<std::mutex> lock(StackMutex());
+      if (FreeStacks().size() < 16) {
+        FreeStacks().push_back(stack);
+        return;
+      }
+    }
+    std::size_t guard = PageSize();
+    ::munmap(static_cast<char*>(stack) - guard, kStackSize + guard);
+  }
+
+  std::function<void()> body_;
+  void* stack_ = nullptr;
+  void* sp_ = nullptr;
+  void* caller_sp_ = nullptr;
+  bool started_ = false;
+  bool finished_ = false;
+  std::exception_ptr error_;
+#ifdef POTATOLANG_ASAN_FIBERS
+  const void* caller_stack_ = nullptr;
+  std::size_t caller_stack_size_ = 0;
+#endif
+};
+#endif
+
+// Thrown at a suspended `yield` to unwind a generator that is being destroyed.
+struct GeneratorExit {};
+
+// An interpreter running on its own thread.
+struct Isolate {
+  std::thread worker;
+  std::atomic<bool> done{false};
+  int exit_code = 0;
+};
+
+// Argument storage for calls: a stack of fixed-size chunks that are kept once allocated.
+// A frame's values are contiguous and stay put while nested calls push frames above it.
+class ValueStack {
+ public:
+  class Frame {
+   public:
+    Frame(ValueStack& stack, std::size_t size) : stack_(stack), size_(size), mark_(stack.top_) {
+      data_ = stack.Push(size);
+    }
+    ~Frame() {
+      for (std::size_t i = 0; i < size_; i++) data_[i] = Value();
+      stack_.top_ = mark_;
+    }
+    Frame(const Frame&) = delete;
+    Frame& operator=(const Frame&) = delete;
+
+    Value& operator[](std::size_t i) { return data_[i]; }
+    Value* data() { return data_; }
+    std::size_t size() const { return size_; }
+    ArgList args() const { return ArgList(data_, size_); }
+
+   private:
+    ValueStack& stack_;
+    Value* data_ = nullptr;
+    std::size_t size_;
+    std::pair<std::size_t, std::size_t> mark_;
+  };
+
+ private:
+  static constexpr std::size_t kChunkSize = 1024;
+
+  struct Chunk {
+    std::unique_ptr<Value[]> values;
+    std::size_t capacity;
+  };
+
+  Value* Push(std::size_t n) {
+    if (n == 0) return nullptr;
+    while (top_.first < chunks_.size()) {
+      Chunk& chunk = chunks_[top_.first];
+      if (chunk.capacity - top_.second >= n) {
+        Value* p = &chunk.values[top_.second];
+        top_.second += n;
+        return p;
+      }
+      top_ = {top_.first + 1, 0};
+    }
+    std::size_t capacity = std::max(kChunkSize, n);
+    chunks_.push_back(Chunk{std::unique_ptr<Value[]>(new Value[capacity]), capacity});
+    top_.second = n;
+    return &chunks_.back().values[0];
+  }
+
+  std::vector<Chunk> chunks_;
+  // (chunk index, offset) of the first free slot.
+  std::pair<std::size_t, std::size_t> top_{0, 0};
+};
+
+// Runtime settings for an Interpreter.
+struct InterpreterOptions {
+  // Flush output after every print/write instead of buffering it.
+  bool unbuffered = false;
+  // Stop the script with a RuntimeError after this many steps (loop iterations plus
+  // function calls); 0 means no limit.
+  std::uint64_t max_steps = 0;
+  // Stop the script with a RuntimeError once a Run has taken this long; 0 means no limit.
+  std::chrono::milliseconds time_limit{0};
+  // Modules and globals to start from, as if the script had imported those modules.
+  std::shared_ptr<const Snapshot> snapshot;
+  // Directories searched for `import name`, ahead of the modules built into the binary.
+  // ./potatos is searched last.
+  std::vector<std::string> module_path;
+};
+
+// Gives std::cout a 64 KiB buffer that reaches the file in one write per 64 KiB. (pubsetbuf
+// on std::cout's own buffer is ignored by libstdc++ once the stream is open.) stdout itself
+// is made unbuffered, as glibc would otherwise split every chunk into two writes; all
+// output to it (std::cout, isolates) is buffered by a StdioStreamBuf already. Must be
+// called before anything is written to stdout. The stream buffer is never destroyed, so
+// output flushed during static destruction still has somewhere to go.
+inline void ConfigureStdout() {
+  std::setvbuf(stdout, nullptr, _IONBF, 0);
+  static StdioStreamBuf* buffer = new StdioStreamBuf(stdout);
+  std::cout.rdbuf(buffer);
+}
+
+class Interpreter {
+ public:
+  Interpreter(std::ostream& out, std::ostream& err, std::string input, InterpreterOptions options = {})
+      : Interpreter(out, err, InputSource::FromString(std::move(input)), options) {}
+
+  // The legacy `input` global is only materialized if the script reads it.
+  Interpreter(std::ostream& out, std::ostream& err, std::shared_ptr<InputSource> input, InterpreterOptions options = {})
+      : out_(out),
+        err_(err),
+        options_(options),
+        globals_(std::make_shared<Environment>()),
+        env_(globals_),
+        input_(std::move(input)) {
+    InstallBuiltins();
+    if (options_.snapshot) {
+      try {
+        RestoreSnapshot(*options_.snapshot);
+      } catch (...) {
+        globals_->values.clear();
+        throw;
+      }
+    }
+    DefineInput();
+    StartLimits();
+  }
+
+  ~Interpreter() {
+    StopIsolates();
+    if (renderer_) SDL_DestroyRenderer(renderer_);
+    if (window_) SDL_DestroyWindow(window_);
+    globals_->values.clear();
+  }
+
+  Interpreter(const Interpreter&) = delete;
+  Interpreter& operator=(const Interpreter&) = delete;
+
+  // Defines (or replaces) a global variable.
+  void DefineGlobal(const std::string& name, Value v) { globals_->Define(name, std::move(v)); }
+
+  // Registers a C++ function as a builtin. The arity and argument conversions come from its
+  // signature (see NativeType), and calls go straight through the function pointer with
+  // no per-call allocation. Registered builtins survive Reset.
+  template <typename R, typename... Args>
+  void Register(const std::string& name, R (*fn)(Args...)) {
+    auto nf = std::make_shared<NativeFunctionValue>();
+    nf->name = name;
+    nf->arity = static_cast<int>(sizeof...(Args));
+    nf->target = reinterpret_cast<void (*)()>(fn);
+    nf->invoke = &NativeThunk<R, Args...>::Invoke;
+    nf->builtin = true;
+    builtins_.push_back(nf);
+    globals_->Define(name, Value::Native(std::move(nf)));
+  }
+
+  // Accepts captureless lambdas by converting them to function pointers.
+  template <typename F, typename = decltype(+std::declval<F>())>
+  void Register(const std::string& name, F fn) {
+    Register(name, +fn);
+  }
+
+  // Returns the interpreter to its freshly constructed state with new input. The builtins
+  // are reused rather than reinstalled, and modules keep their parsed ASTs (they are
+  // still re-executed on import).
+  void Reset(std::shared_ptr<InputSource> input) {
+    StopIsolates();
+    isolates_.clear();
+    processes_.clear();
+    files_.clear();
+    timers_.clear();
+    timer_queue_.clear();
+    fd_watchers_.clear();
+    in_loop_ = false;
+    loop_stopped_ = false;
+    next_file_handle_ = 1;
+    next_timer_id_ = 1;
+    next_process_handle_ = 1;
+    next_isolate_handle_ = 1;
+    channels_ = std::make_shared<ChannelTable>();
+    for (auto& w : workers_) {
+      w->interp->Reset(InputSource::FromString(""));
+      w->interp->channels_ = channels_;
+    }
+
+    // Global functions close over the global scope; clearing it breaks those cycles.
+    globals_->values.clear();
+    globals_ = std::make_shared<Environment>();
+    env_ = globals_;
+    globals_->values.reserve(builtins_.size() + 1);
+    for (const auto& nf : builtins_) globals_->values.emplace(nf->name, Value::Native(nf));
+    imported_modules_.clear();
+    if (options_.snapshot) RestoreSnapshot(*options_.snapshot);
+    program_.reset();
+    input_ = std::move(input);
+    DefineInput();
+    cancel_requested_ = false;
+    StartLimits();
+  }
+
+  // Encodes the imported modules and the global scope in the format Snapshot::Load reads.
+  // Builtins are stored by name and functions by their position in a module. Throws
+  // RuntimeError for globals that cannot be restored that way, such as closures over a
+  // local scope or natives created while running.
+  std::string EncodeSnapshot() const {
+    std::string out(kSnapshotMagic, 4);
+    AstWriter w(out);
+    std::vector<std::string> modules;
+    for (const auto& m : imported_modules_) {
+      if (imported_programs_.count(m.first) > 0) modules.push_back(m.first);
+    }
+    std::sort(modules.begin(), modules.end());
+    std::unordered_map<const Stmt*, std::pair<std::size_t, std::size_t>> functions;
+    w.PutVarint(modules.size());
+    for (std::size_t i = 0; i < modules.size(); i++) {
+      const std::vector<StmtPtr>& stmts = imported_programs_.at(modules[i]).program->statements();
+      w.PutString(modules[i]);
+      w.WriteStmts(stmts);
+      for (std::size_t j = 0; j < stmts.size(); j++) functions[stmts[j].get()] = {i, j};
+    }
+
+    std::vector<std::string> names;
+    for (const auto& g : globals_->values) {
+      if (g.first == "input") continue;  // Redefined for every run.
+      if (IsNative(g.second)) {
+        auto nf = std::get<std::shared_ptr<NativeFunctionValue>>(g.second.v);
+        if (nf->name == g.first && std::find(builtins_.begin(), builtins_.end(), nf) != builtins_.end()) continue;
+      }
+      names.push_back(g.first);
+    }
+    std::sort(names.begin(), names.end());
+    w.PutVarint(names.size());
+    auto values = std::make_shared<ListValue>();
+    std::vector<std::string> value_names;
+    for (const auto& name : names) {
+      const Value& v = globals_->values.at(name);
+      w.PutString(name);
+      if (IsNative(v)) {
+        auto nf = std::get<std::shared_ptr<NativeFunctionValue>>(v.v);
+        if (std::find(builtins_.begin(), builtins_.end(), nf) == builtins_.end()) {
+          throw RuntimeError("Cannot snapshot global " + name + ": not a builtin");
+        }
+        out.push_back(static_cast<char>(Snapshot::Global::Kind::Builtin));
+        w.PutString(nf->name);
+      } else if (IsFunc(v)) {
+        auto f = std::get<std::shared_ptr<FunctionValue>>(v.v);
+        auto it = functions.find(f->decl);
+        if (it == functions.end() || f->closure != globals_) {
+          throw RuntimeError("Cannot snapshot global " + name + ": not a top-level module function");
+        }
+        out.push_back(static_cast<char>(Snapshot::Global::Kind::Function));
+        w.PutVarint(it->second.first);
+        w.PutVarint(it->second.second);
+      } else {
+        out.push_back(static_cast<char>(Snapshot::Global::Kind::Value));
+        values->items.push_back(v);
+        value_names.push_back(name);
+      }
+    }
+    std::string bytes;
+    try {
+      bytes = ValueWriter::Encode(Value::List(values));
+    } catch (const RuntimeError& e) {
+      // Name the global that cannot be stored.
+      for (std::size_t i = 0; i < values->items.size(); i++) {
+        try {
+          ValueWriter::Encode(values->items[i]);
+        } catch (const RuntimeError& inner) {
+          throw RuntimeError("Cannot snapshot global " + value_names[i] + ": " + inner.what());
+        }
+      }
+      throw RuntimeError(std::string("Cannot snapshot globals: ") + e.what());
+    }
+    w.PutString(bytes);
+    return out;
+  }
+
+  // Asks the running script to stop: it fails with a RuntimeError at its next loop
+  // iteration or function call, and so do its par_map workers and isolates. Safe to call
+  // from any thread; stays set until Reset.
+  void RequestCancel() { cancel_requested_.store(true, std::memory_order_relaxed); }
+
+  // Runs a compiled program, keeping it alive for as long as this interpreter may
+  // refer to its functions.
+  int Run(std::shared_ptr<const CompiledProgram> program) {
+    program_ = std::move(program);
+    return Run(program_->statements());
+  }
+
+  // Run the interpreter on the provided AST.
+  // Returns 0 on success, 1 on runtime error.
+  int Run(const std::vector<StmtPtr>& program) {
+    StartLimits();
+    try {
+      for (const auto& s : program) {
+        if (Execute(s.get())) break;
+      }
+      out_.flush();
+      return 0;
+    } catch (const RuntimeError& e) {
+      out_.flush();
+      err_ << "Runtime error: " << e.what() << "\n";
+      return 1;
+    }
+  }
+
+ private:
+  // Install built-in native functions into the global scope.
+  void InstallBuiltins() {
+    auto add = [&](std::string name, int arity, std::function<Value(ArgList)> fn) {
+      auto nf = std::make_shared<NativeFunctionValue>();
+      nf->name = std::move(name);
+      nf->arity = arity;
+      nf->fn = std::move(fn);
+      nf->builtin = true;
+      builtins_.push_back(nf);
+      globals_->Define(nf->name, Value::Native(nf));
+    };
+
+    // Creates a new empty list.
+    add("list", 0, [&](ArgList) { return Value::List(std::make_shared<ListValue>()); });
+    
+    // Pushes an item to the end of a list.
+    add("push", 2, [&](ArgList args) {
+      auto l = AsMutableList(args[0]);
+      l->items.push_back(args[1]);
+      return args[0];
+    });
+    
+    // Gets an item from a list by index.
+    add("get", 2, [&](ArgList args) {
+      auto l = AsList(args[0]);
+      int i = static_cast<int>(AsNumber(args[1]));
+      if (i < 0 || i >= static_cast<int>(l->items.size())) return Value::Nil();
+      return l->items[static_cast<std::size_t>(i)];
+    });
+    
+    // Sets an item in a list by index.
+    add("set", 3, [&](ArgList args) {
+      auto l = AsMutableList(args[0]);
+      int i = static_cast<int>(AsNumber(args[1]));
+      if (i < 0 || i >= static_cast<int>(l->items.size())) throw RuntimeError("Index out of range");
+      l->items[static_cast<std::size_t>(i)] = args[2];
+      return args[0];
+    });
+
+    // Removes an item from a list by index.
+    add("remove_at", 2, [&](ArgList args) {
+      auto l = AsMutableList(args[0]);
+      int i = static_cast<int>(AsNumber(args[1]));
+      if (i < 0 || i >= static_cast<int>(l->items.size())) throw RuntimeError("Index out of range");
+      l->items.erase(l->items.begin() + i);
+      return Value::Nil();
+    });
+    
+    // Returns the length of a string or list.
+    add("len", 1, [&](ArgList args) {
+      if (IsString(args[0])) return Value::Number(static_cast<double>(AsString(args[0]).size()));
+      if (IsList(args[0])) return Value::Number(static_cast<double>(AsList(args[0])->items.size()));
+      throw RuntimeError("len() expects string or list");
+    });
+    // Returns a substring of a string.
+    Register("substr", [](const std::string& s, int start, int count) -> std::string {
+      if (count <= 0) return "";
+      if (start < 0) start = 0;
+      if (start > static_cast<int>(s.size())) start = static_cast<int>(s.size());
+      int end = start + count;
+      if (end > static_cast<int>(s.size())) end = static_cast<int>(s.size());
+      return s.substr(static_cast<std::size_t>(start), static_cast<std::size_t>(end - start));
+    });
+
+    // Returns the character at a specific index in a string.
+    Register("char_at", [](const std::string& s, int i) -> std::string {
+      if (i < 0 || i >= static_cast<int>(s.size())) return "";
+      return std::string(1, s[static_cast<std::size_t>(i)]);
+    });
+
+    // Converts any value to a string representation.
+    add("to_string", 1, [&](ArgList args) { return Value::Str(ValueToString(args[0])); });
+    
+    // Writes a string to standard output.
+    add("write", 1, [&](ArgList args) {
+      out_ << ValueToString(args[0]);
+      if (options_.unbuffered) out_.flush();
+      return Value::Nil();
+    });
+
+    // Flushes buffered standard output.
+    add("flush", 0, [&](ArgList) {
+      out_.flush();
+      return Value::Nil();
+    });
+
+    // Checks if a string contains only digits.
+    Register("is_digit", [](const std::string& s) {
+      return s.size() == 1 && std::isdigit(static_cast<unsigned char>(s[0])) != 0;
+    });
+
+    // Checks if a string contains only alphabetic characters.
+    Register("is_alpha", [](const std::string& s) {
+      return s.size() == 1 && (std::isalpha(static_cast<unsigned char>(s[0])) != 0 || s[0] == '_');
+    });
+
+    // Checks if a string contains only alphanumeric characters.
+    Register("is_alnum", [](const std::string& s) {
+      return s.size() == 1 && (std::isalnum(static_cast<unsigned char>(s[0])) != 0 || s[0] == '_');
+    });
+
+    // Returns the end offset of the run starting at pos whose bytes belong to a class.
+    // The class is "digit", "alpha", "ident", "space", or otherwise a literal set of bytes.
+    add("scan_while", 3, [&](ArgList args) {
+      const std::string& s = AsString(args[0]);
+      std::size_t i = ClampOffset(args[1], s.size());
+      const std::string& cls = AsString(args[2]);
+      const ByteSet* named = ByteSet::Named(cls);
+      ByteSet custom;
+      if (!named) custom = ByteSet::FromChars(cls);
+      const ByteSet& set = named ? *named : custom;
+      while (i < s.size() && set.Has(s[i])) i++;
+      return Value::Number(static_cast<double>(i));
+    });
+
+    // Returns the offset of the first byte at or after pos that is one of chars, or len(s).
+    add("scan_until", 3, [&](ArgList args) {
+      const std::string& s = AsString(args[0]);
+      std::size_t i = ClampOffset(args[1], s.size());
+      const std::string& chars = AsString(args[2]);
+      if (chars.size() == 1) {
+        std::size_t pos = s.find(chars[0], i);
+        return Value::Number(static_cast<double>(pos == std::string::npos ? s.size() : pos));
+      }
+      ByteSet set = ByteSet::FromChars(chars);
+      while (i < s.size() && !set.Has(s[i])) i++;
+      return Value::Number(static_cast<double>(i));
+    });
+
+    // Tokenizes source with the native lexer.
+    // Returns [types, lexemes, lines, columns] as four parallel lists, ending with an "Eof" token.
+    add("tokenize", 1, [&](ArgList args) {
+      std::vector<Token> tokens = Lexer(AsString(args[0])).LexAll();
+      auto types = std::make_shared<ListValue>();
+      auto lexemes = std::make_shared<ListValue>();
+      auto lines = std::make_shared<ListValue>();
+      auto cols = std::make_shared<ListValue>();
+      types->items.reserve(tokens.size());
+      lexemes->items.reserve(tokens.size());
+      lines->items.reserve(tokens.size());
+      cols->items.reserve(tokens.size());
+      for (auto& t : tokens) {
+        types->items.push_back(Value::Str(TokenTypeName(t.type)));
+        lexemes->items.push_back(Value::Str(std::move(t.lexeme)));
+        lines->items.push_back(Value::Number(t.loc.line));
+        cols->items.push_back(Value::Number(t.loc.column));
+      }
+      auto out = std::make_shared<ListValue>();
+      out->items = {Value::List(types), Value::List(lexemes), Value::List(lines), Value::List(cols)};
+      return Value::List(out);
+    });
+
+    // Encodes a value (nested lists included) as a compact binary string.
+    add("serialize", 1, [&](ArgList args) { return Value::Str(ValueWriter::Encode(args[0])); });
+
+    // Decodes a string produced by serialize.
+    add("deserialize", 1, [&](ArgList args) {
+      const std::string& data = AsString(args[0]);
+      return ValueReader::Decode(data.data(), data.size());
+    });
+
+    // Serializes a value straight to a file. Returns true on success.
+    add("save_value", 2, [&](ArgList args) {
+      std::string data = ValueWriter::Encode(args[1]);
+      std::ofstream f(AsString(args[0]), std::ios::binary);
+      if (!f) return Value::Bool(false);
+      f.write(data.data(), static_cast<std::streamsize>(data.size()));
+      return Value::Bool(static_cast<bool>(f));
+    });
+
+    // Loads a value saved by save_value, decoding directly from the mapped file. Returns nil if it cannot be opened.
+    add("load_value", 1, [&](ArgList args) {
+      std::unique_ptr<MappedFile> f = MappedFile::Open(AsString(args[0]));
+      if (!f) return Value::Nil();
+      return ValueReader::Decode(f->data(), f->size());
+    });
+
+    // Parses a JSON document.
+    add("json_parse", 1, [&](ArgList args) {
+      const std::string& text = AsString(args[0]);
+      return JsonParser::Parse(text.data(), text.size());
+    });
+
+    // Converts a value to JSON text.
+    add("json_stringify", 1, [&](ArgList args) { return Value::Str(JsonWriter::Write(args[0])); });
+
+    // Creates an empty JSON object (a list of [key, value] pairs).
+    add("json_object", 0, [&](ArgList) {
+      auto obj = std::make_shared<ListValue>();
+      obj->is_object = true;
+      return Value::List(obj);
+    });
+
+    // Looks up a key in a JSON object; returns nil if missing.
+    add("json_get", 2, [&](ArgList args) {
+      Value* v = FindObjectKey(*AsList(args[0]), AsString(args[1]));
+      return v ? *v : Value::Nil();
+    });
+
+    // Sets a key in a JSON object, replacing an existing entry. Returns the object.
+    add("json_set", 3, [&](ArgList args) {
+      const std::string& key = AsString(args[1]);
+      auto obj = AsMutableList(args[0]);
+      if (Value* v = FindObjectKey(*obj, key)) {
+        *v = args[2];
+        return args[0];
+      }
+      auto pair = std::make_shared<ListValue>();
+      pair->items = {Value::Str(key), args[2]};
+      obj->items.push_back(Value::List(pair));
+      return args[0];
+    });
+
+    // Calls fn(element) for each element of a top-level JSON array, one at a time.
+    // source is a file path, or nil for the script input. Returns the number of elements.
+    add("json_each", 2, [&](ArgList args) {
+      std::shared_ptr<InputSource> src = IsNil(args[0]) ? input_ : OpenInput(AsString(args[0]));
+      JsonArrayStream stream([src]() { return src->Read(InputSource::kStreamBufferSize); });
+      std::string element;
+      double count = 0;
+      while (stream.Next(element)) {
+        Call(args[1], {JsonParser::Parse(element.data(), element.size())});
+        count++;
+      }
+      return Value::Number(count);
+    });
+
+    // Returns a function that yields the next CSV row as a list on each call, or nil at end of input.
+    // source is a file path, or nil for the script input. opts is nil, a delimiter string, or an
+    // object (see json_object) with "delimiter", "quote", "skip_header" and "types" keys. "types" is
+    // "auto" or a list of "number"/"string"/"auto" per column; numeric columns yield numbers.
+    add("csv_reader", 2, [&](ArgList args) {
+      std::shared_ptr<InputSource> src = IsNil(args[0]) ? input_ : OpenInput(AsString(args[0]));
+      char delimiter = ',';
+      char quote = '"';
+      bool skip_header = false;
+      std::vector<std::string> types;
+      std::string default_type = "string";
+      const Value& opts = args[1];
+      if (IsString(opts)) {
+        if (AsString(opts).size() != 1) throw RuntimeError("csv_reader() delimiter must be one character");
+        delimiter = AsString(opts)[0];
+      } else if (IsList(opts)) {
+        ListValue& o = *AsList(opts);
+        if (Value* v = FindObjectKey(o, "delimiter")) {
+          if (AsString(*v).size() != 1) throw RuntimeError("csv_reader() delimiter must be one character");
+          delimiter = AsString(*v)[0];
+        }
+        if (Value* v = FindObjectKey(o, "quote")) {
+          if (AsString(*v).size() != 1) throw RuntimeError("csv_reader() quote must be one character");
+          quote = AsString(*v)[0];
+        }
+        if (Value* v = FindObjectKey(o, "skip_header")) skip_header = IsTruthy(*v);
+        if (Value* v = FindObjectKey(o, "types")) {
+          if (IsString(*v)) default_type = AsString(*v);
+          else types = StringList(*v);
+        }
+      } else if (!IsNil(opts)) {
+        throw RuntimeError("csv_reader() options must be nil, a delimiter or an object");
+      }
+      for (const auto& t : types) {
+        if (t != "string" && t != "number" && t != "auto") throw RuntimeError("csv_reader() unknown column type: " + t);
+      }
+      if (default_type != "string" && default_type != "auto") throw RuntimeError("csv_reader() unknown column type: " + default_type);
+
+      auto reader = std::make_shared<CsvReader>(src, delimiter, quote);
+      auto skip = std::make_shared<bool>(skip_header);
+      auto nf = std::make_shared<NativeFunctionValue>();
+      nf->name = "csv_reader";
+      nf->arity = 0;
+      nf->fn = [reader, skip, types, default_type](ArgList) {
+        std::vector<std::string> fields;
+        if (*skip) {
+          *skip = false;
+          if (!reader->NextRow(fields)) return Value::Nil();
+        }
+        if (!reader->NextRow(fields)) return Value::Nil();
+        auto row = std::make_shared<ListValue>();
+        row->items.reserve(fields.size());
+        for (std::size_t i = 0; i < fields.size(); i++) {
+          const std::string& type = i < types.size() ? types[i] : default_type;
+          std::string& f = fields[i];
+          if (type == "string") {
+            row->items.push_back(Value::Str(std::move(f)));
+            continue;
+          }
+          double x = 0;
+          if (ParseCsvNumber(f, x)) {
+            row->items.push_back(Value::Number(x));
+          } else if (type == "auto") {
+            row->items.push_back(Value::Str(std::move(f)));
+          } else if (f.empty()) {
+            row->items.push_back(Value::Nil());
+          } else {
+            throw RuntimeError("csv: column " + std::to_string(i) + " is not a number: " + f);
+          }
+        }
+        return Value::List(row);
+      };
+      return Value::Native(nf);
+    });
+
+    // Creates a bounded channel for passing values between isolates. Returns its id.
+    add("chan", 1, [&](ArgList args) {
+      double capacity = AsNumber(args[0]);
+      return Value::Number(channels_->Create(capacity > 1 ? static_cast<std::size_t>(capacity) : 1));
+    });
+
+    // Sends a deep copy of a value, blocking while the channel is full. Returns false if it is closed.
+    add("chan_send", 2, [&](ArgList args) {
+      std::shared_ptr<Channel> ch = ChannelHandle(args[0]);
+      std::string message = ValueWriter::Encode(args[1]);
+      out_.flush();
+      return Value::Bool(ch->Send(std::move(message), [this] { CheckCancelled(); }));
+    });
+
+    // Receives a value, blocking while the channel is empty. Returns nil once it is closed and drained.
+    add("chan_recv", 1, [&](ArgList args) {
+      std::shared_ptr<Channel> ch = ChannelHandle(args[0]);
+      out_.flush();
+      std::string message;
+      if (!ch->Recv(message, [this] { CheckCancelled(); })) return Value::Nil();
+      return ValueReader::Decode(message.data(), message.size());
+    });
+
+    // Closes a channel; pending values can still be received.
+    add("chan_close", 1, [&](ArgList args) {
+      ChannelHandle(args[0])->Close();
+      return Value::Nil();
+    });
+
+    // Runs a script (a .pt path or source text) in a new interpreter on its own thread.
+    // The isolate sees a deep copy of arg as the global isolate_arg. Returns a handle for isolate_join.
+    // It shares this interpreter's step budget and deadline and is cancelled along with it.
+    add("spawn_isolate", 2, [&](ArgList args) {
+      const std::string& spec = AsString(args[0]);
+      std::string source;
+      if (spec.find('\n') == std::string::npos && spec.size() > 3 && spec.compare(spec.size() - 3, 3, ".pt") == 0) {
+        if (!ReadWholeFile(spec, source)) throw RuntimeError("Failed to open isolate script: " + spec);
+      } else {
+        source = spec;
+      }
+      std::string arg = ValueWriter::Encode(args[1]);
+      auto iso = std::make_shared<Isolate>();
+      Isolate* raw = iso.get();
+      iso->worker = std::thread([this, raw, source = std::move(source), arg = std::move(arg), options = options_,
+                                 channels = channels_]() {
+        StdioStreamBuf out_buf(stdout), err_buf(stderr);
+        std::ostream out(&out_buf), err(&err_buf);
+        try {
+          std::vector<StmtPtr> program;
+          if (!CompileSource(source, program, err)) {
+            raw->exit_code = 1;
+          } else {
+            Interpreter interp(out, err, InputSource::FromString(""), options);
+            interp.limits_parent_ = this;
+            interp.channels_ = channels;
+            interp.DefineGlobal("isolate_arg", ValueReader::Decode(arg.data(), arg.size()));
+            raw->exit_code = interp.Run(program);
+          }
+        } catch (const std::exception& e) {
+          // Nothing may escape a thread body; report it like a failed run instead.
+          err << "Runtime error: " << e.what() << "\n";
+          raw->exit_code = 1;
+        }
+        out.flush();
+        err.flush();
+        raw->done = true;
+      });
+      int handle = next_isolate_handle_++;
+      isolates_[handle] = std::move(iso);
+      return Value::Number(handle);
+    });
+
+    // Waits for an isolate to finish and returns its exit code (0 on success).
+    add("isolate_join", 1, [&](ArgList args) {
+      auto it = isolates_.find(static_cast<int>(AsNumber(args[0])));
+      if (it == isolates_.end()) throw RuntimeError("Invalid isolate handle");
+      out_.flush();
+      std::shared_ptr<Isolate> iso = std::move(it->second);
+      isolates_.erase(it);
+      iso->worker.join();
+      return Value::Number(iso->exit_code);
+    });
+
+    // Applies fn to every element in parallel and returns the results in order.
+    // fn may not assign to variables outside itself or modify lists that existed before the call.
+    add("par_map", 2, [&](ArgList args) {
+      std::shared_ptr<ListValue> items = AsList(args[0]);
+      const Value& fn = args[1];
+      auto results = std::make_shared<ListValue>();
+      results->items.resize(items->items.size());
+      std::size_t grain = std::max<std::size_t>(1, items->items.size() / (ParallelWorkerCount() * 64));
+      ParallelFor(items->items.size(), grain, [&](Interpreter& worker, std::size_t begin, std::size_t end) {
+        std::vector<Value> call_args(1);
+        for (std::size_t i = begin; i < end; i++) {
+          call_args[0] = items->items[i];
+          results->items[i] = worker.Call(fn, call_args);
+        }
+      });
+      return Value::List(std::move(results));
+    });
+
+    // Folds the list with fn(acc, item) starting from init, reducing blocks in parallel.
+    // fn must be associative; the block results are combined in list order.
+    add("par_reduce", 3, [&](ArgList args) {
+      std::shared_ptr<ListValue> items = AsList(args[0]);
+      const Value& fn = args[1];
+      std::size_t n = items->items.size();
+      std::size_t block = std::max<std::size_t>(1, n / (ParallelWorkerCount() * 8));
+      std::size_t blocks = (n + block - 1) / block;
+      std::vector<Value> partials(blocks);
+      ParallelFor(blocks, 1, [&](Interpreter& worker, std::size_t begin, std::size_t end) {
+        std::vector<Value> call_args(2);
+        for (std::size_t b = begin; b < end; b++) {
+          std::size_t first = b * block, last = std::min(n, first + block);
+          Value acc = items->items[first];
+          for (std::size_t i = first + 1; i < last; i++) {
+            call_args[0] = std::move(acc);
+            call_args[1] = items->items[i];
+            acc = worker.Call(fn, call_args);
+          }
+          partials[b] = std::move(acc);
+        }
+      });
+      Value acc = args[2];
+      for (auto& p : partials) acc = Call(fn, {std::move(acc), std::move(p)});
+      return acc;
+    });
+
+    // Converts a number to an integer (truncates decimal part).
+    Register("int", [](double x) { return static_cast<double>(static_cast<long long>(x)); });
+
+    // Reads a line from standard input.
+    add("read_line", 0, [&](ArgList) {
+      out_.flush();
+      std::string line;
+      if (std::getline(std::cin, line)) {
+        return Value::Str(line);
+      }
+      return Value::Nil();
+    });
+
+    // Returns the input size in bytes, or nil when reading from a pipe.
+    add("input_size", 0, [&](ArgList) {
+      std::optional<std::size_t> n = input_->Size();
+      if (!n) return Value::Nil();
+      return Value::Number(static_cast<double>(*n));
+    });
+
+    // Reads up to N bytes of input; returns nil at end of input.
+    add("input_read", 1, [&](ArgList args) {
+      std::size_t n = AsByteCount(args[0]);
+      if (n == 0) return Value::Str("");
+      std::string chunk = input_->Read(n);
+      if (chunk.empty()) return Value::Nil();
+      return Value::Str(std::move(chunk));
+    });
+
+    // Returns a function that yields the next input line on each call, or nil at end of input.
+    add("input_lines", 0, [&](ArgList) {
+      std::shared_ptr<InputSource> src = input_;
+      auto nf = std::make_shared<NativeFunctionValue>();
+      nf->name = "input_lines";
+      nf->arity = 0;
+      nf->fn = [src](ArgList) {
+        std::string line;
+        if (!src->ReadLine(line)) return Value::Nil();
+        return Value::Str(std::move(line));
+      };
+      return Value::Native(nf);
+    });
+
+    // Sleeps for N milliseconds.
+    add("sleep", 1, [&](ArgList args) {
+      out_.flush();
+      int ms = static_cast<int>(AsNumber(args[0]));
+      if (ms > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+      }
+      return Value::Nil();
+    });
+    
+    // Returns a random number between 0 and 1.
+    add("random", 0, [&](ArgList) {
+      std::uniform_real_distribution<double> dist(0.0, 1.0);
+      return Value::Number(dist(rng_));
+    });
+    
+    // Execute a shell command and return its output
+    add("exec", 1, [&](ArgList args) {
+        out_.flush();
+        std::string cmd = AsString(args[0]);
+#ifndef _WIN32
+        return Value::Str(RunProcess({"/bin/sh", "-c", cmd}, nullptr, false).out);
+#else
+        std::array<char, 1 << 16> buffer;
+        std::string result;
+        std::unique_ptr<FILE, decltype(&_pclose)> pipe(_popen(cmd.c_str(), "r"), _pclose);
+        if (!pipe) {
+            return Value::Str("popen() failed!");
+        }
+        std::size_t n;
+        while ((n = std::fread(buffer.data(), 1, buffer.size(), pipe.get())) > 0) {
+            result.append(buffer.data(), n);
+        }
+        return Value::Str(result);
+#endif
+    });
+
+    // Runs a program without a shell. args: argv list, stdin string (or nil).
+    // Returns [exit_code, stdout, stderr].
+    add("spawn", 2, [&](ArgList args) {
+        out_.flush();
+        std::vector<std::string> argv = StringList(args[0]);
+        std::string stdin_data = IsNil(args[1]) ? "" : AsString(args[1]);
+        return ProcessResultValue(RunProcess(argv, &stdin_data, true));
+    });
+
+    // Starts a program in the background and returns a handle for spawn_wait/spawn_poll/spawn_fd.
+    add("spawn_async", 2, [&](ArgList args) {
+        out_.flush();
+        auto proc = std::make_shared<AsyncProcess>();
+        std::vector<std::string> argv = StringList(args[0]);
+        std::string stdin_data = IsNil(args[1]) ? "" : AsString(args[1]);
+#ifndef _WIN32
+        if (PipeCloexec(proc->notify_fd) != 0) throw RuntimeError("pipe() failed");
+#endif
+        AsyncProcess* raw = proc.get();
+        proc->worker = std::thread([raw, argv = std::move(argv), stdin_data = std::move(stdin_data)]() {
+            try {
+                raw->result = RunProcess(argv, &stdin_data, true);
+            } catch (const std::exception& e) {
+                raw->error = e.what();
+            }
+#ifndef _WIN32
+            char done = 1;
+            while (::write(raw->notify_fd[1], &done, 1) < 0 && errno == EINTR) {
+            }
+#endif
+        });
+        int handle = next_process_handle_++;
+        processes_[handle] = std::move(proc);
+        return Value::Number(handle);
+    });
+
+    // Returns a file descriptor that becomes readable (see on_readable) when the process exits.
+    add("spawn_fd", 1, [&](ArgList args) {
+        return Value::Number(ProcessHandle(args[0])->notify_fd[0]);
+    });
+
+    // Returns [exit_code, stdout, stderr] if the process has finished, otherwise nil.
+    add("spawn_poll", 1, [&](ArgList args) {
+#ifndef _WIN32
+        pollfd pfd{ProcessHandle(args[0])->notify_fd[0], POLLIN, 0};
+        if (::poll(&pfd, 1, 0) <= 0) return Value::Nil();
+#endif
+        return FinishProcess(args[0]);
+    });
+
+    // Waits for the process to finish and returns [exit_code, stdout, stderr].
+    add("spawn_wait", 1, [&](ArgList args) {
+        out_.flush();
+        return FinishProcess(args[0]);
+    });
+
+    // Calls fn once after N milliseconds when the event loop runs. Returns a timer id.
+    add("set_timeout", 2, [&](ArgList args) {
+      return Value::Number(AddTimer(AsNumber(args[0]), args[1], false));
+    });
+
+    // Calls fn every N milliseconds while the event loop runs. Returns a timer id.
+    add("set_interval", 2, [&](ArgList args) {
+      return Value::Number(AddTimer(AsNumber(args[0]), args[1], true));
+    });
+
+    // Cancels a timer created by set_timeout or set_interval.
+    add("clear_timer", 1, [&](ArgList args) {
+      int id = static_cast<int>(AsNumber(args[0]));
+      auto it = timers_.find(id);
+      if (it == timers_.end()) return Value::Bool(false);
+      timer_queue_.erase({it->second.due, id});
+      timers_.erase(it);
+      return Value::Bool(true);
+    });
+
+    // Calls fn(fd) whenever the file descriptor is readable (0 is standard input).
+    add("on_readable", 2, [&](ArgList args) {
+      if (!IsFunc(args[1]) && !IsNative(args[1])) throw RuntimeError("on_readable() expects a function");
+      fd_watchers_[static_cast<int>(AsNumber(args[0]))] = args[1];
+      return Value::Nil();
+    });
+
+    // Stops watching a file descriptor.
+    add("off_readable", 1, [&](ArgList args) {
+      return Value::Bool(fd_watchers_.erase(static_cast<int>(AsNumber(args[0]))) > 0);
+    });
+
+    // Reads whatever is available on a file descriptor (up to N bytes); nil at end of file.
+    add("fd_read", 2, [&](ArgList args) {
+#ifndef _WIN32
+      int fd = static_cast<int>(AsNumber(args[0]));
+      // One read returns at most what the pipe or socket holds, so a larger buffer is never used.
+      std::string buf(std::min<std::size_t>(AsByteCount(args[1]), kFileBufferSize), '\0');
+      if (buf.empty()) return Value::Str("");
+      while (true) {
+        ssize_t got = ::read(fd, &buf[0], buf.size());
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return Value::Str("");
+        if (got <= 0) return Value::Nil();
+        buf.resize(static_cast<std::size_t>(got));
+        return Value::Str(std::move(buf));
+      }
+#else
+      throw RuntimeError("fd_read() is not supported on this platform");
+#endif
+    });
+
+    // Runs timers and readiness callbacks until none remain or stop_loop() is called.
+    add("run_loop", 0, [&](ArgList) {
+      RunLoop();
+      return Value::Nil();
+    });
+
+    // Makes run_loop() return after the current callback.
+    add("stop_loop", 0, [&](ArgList) {
+      loop_stopped_ = true;
+      return Value::Nil();
+    });
+
+    // Returns current timestamp in seconds.
+    add("time", 0, [&](ArgList) {
+        auto now = std::chrono::system_clock::now();
+        auto duration = now.time_since_epoch();
+        double seconds = std::chrono::duration_cast<std::chrono::duration<double>>(duration).count();
+        return Value::Number(seconds);
+    });
+
+    // Returns a string containing a single character with the given ASCII code.
+    add("char", 1, [&](ArgList args) {
+        int code = static_cast<int>(AsNumber(args[0]));
+        return Value::Str(std::string(1, static_cast<char>(code)));
+    });
+
+    // Execute a system command
+    add("system", 1, [&](ArgList args) {
+        out_.flush();
+        std::string cmd = AsString(args[0]);
+        int ret = std::system(cmd.c_str());
+        return Value::Number(static_cast<double>(ret));
+    });
+
+    // Initialize Graphics Window
+    add("graphics_init", 3, [&](ArgList args) {
+        int w = static_cast<int>(AsNumber(args[0]));
+        int h = static_cast<int>(AsNumber(args[1]));
+        std::string title = AsString(args[2]);
+        if (SDL_Init(SDL_INIT_VIDEO) < 0) return Value::Bool(false);
+        window_ = SDL_CreateWindow(title.c_str(), SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, w, h, SDL_WINDOW_SHOWN);
+        if (!window_) return Value::Bool(false);
+        renderer_ = SDL_CreateRenderer(window_, -1, SDL_RENDERER_ACCELERATED);
+        return Value::Bool(renderer_ != nullptr);
+    });
+
+    // Set Draw Color
+    add("graphics_color", 3, [&](ArgList args) {
+        int r = static_cast<int>(AsNumber(args[0]));
         int g = static_cast<int>(AsNumber(args[1]));
         int b = static_cast<int>(AsNumber(args[2]));
-        if (g_renderer) SDL_SetRenderDrawColor(g_renderer, r, g, b, 255);
+        if (renderer_) SDL_SetRenderDrawColor(renderer_, r, g, b, 255);
         return Value::Nil();
     });
 
     // Clear Screen
-    add("graphics_clear", 0, [&](const std::vector<Value>&) {
-        if (g_renderer) SDL_RenderClear(g_renderer);
+    add("graphics_clear", 0, [&](ArgList) {
+        if (renderer_) SDL_RenderClear(renderer_);
         return Value::Nil();
     });
 
     // Draw Rectangle
-    add("graphics_rect", 4, [&](const std::vector<Value>& args) {
-        if (g_renderer) {
+    add("graphics_rect", 4, [&](ArgList args) {
+        if (renderer_) {
             SDL_Rect r;
             r.x = static_cast<int>(AsNumber(args[0]));
             r.y = static_cast<int>(AsNumber(args[1]));
             r.w = static_cast<int>(AsNumber(args[2]));
             r.h = static_cast<int>(AsNumber(args[3]));
-            SDL_RenderFillRect(g_renderer, &r);
+            SDL_RenderFillRect(renderer_, &r);
         }
         return Value::Nil();
     });
 
     // Draw Text using 5x7 bitmap font
     // args: x, y, text
-    add("graphics_draw_text", 3, [&](const std::vector<Value>& args) {
-        if (g_renderer) {
+    add("graphics_draw_text", 3, [&](ArgList args) {
+        if (renderer_) {
             int x = static_cast<int>(AsNumber(args[0]));
             int y = static_cast<int>(AsNumber(args[1]));
             std::string text = AsString(args[2]);
@@ -1336,7 +4727,7 @@ class Interpreter {
                     unsigned char col_data = kFont5x7[index + col];
                     for (int row = 0; row < 7; ++row) {
                         if ((col_data >> row) & 1) {
-                            SDL_RenderDrawPoint(g_renderer, x + col, y + row);
+                            SDL_RenderDrawPoint(renderer_, x + col, y + row);
                         }
                     }
                 }
@@ -1347,13 +4738,13 @@ class Interpreter {
     });
 
     // Present (Update Screen)
-    add("graphics_present", 0, [&](const std::vector<Value>&) {
-        if (g_renderer) SDL_RenderPresent(g_renderer);
+    add("graphics_present", 0, [&](ArgList) {
+        if (renderer_) SDL_RenderPresent(renderer_);
         return Value::Nil();
     });
 
     // Poll Event
-    add("graphics_poll", 0, [&](const std::vector<Value>&) {
+    add("graphics_poll", 0, [&](ArgList) {
         SDL_Event e;
         if (SDL_PollEvent(&e)) {
             if (e.type == SDL_QUIT) return Value::Str("quit");
@@ -1367,76 +4758,473 @@ class Interpreter {
         return Value::Nil();
     });
 
-    // Check if file exists
-    add("_file_exists", 1, [&](const std::vector<Value>& args) {
-        std::string path = AsString(args[0]);
-        std::ifstream f(path);
-        return Value::Bool(f.good());
-    });
+    // Check if file exists
+    add("_file_exists", 1, [&](ArgList args) {
+        std::string path = AsString(args[0]);
+        std::ifstream f(path);
+        return Value::Bool(f.good());
+    });
+
+    // Read file content
+    add("_file_read", 1, [&](ArgList args) {
+        std::string content;
+        if (!ReadWholeFile(AsString(args[0]), content)) return Value::Nil();
+        return Value::Str(std::move(content));
+    });
+
+    // Write content to file
+    add("_file_write", 2, [&](ArgList args) {
+        std::string path = AsString(args[0]);
+        std::string content = AsString(args[1]);
+        std::ofstream f(path);
+        if (!f) return Value::Bool(false);
+        f << content;
+        return Value::Bool(true);
+    });
+
+    // Append content to file
+    add("_file_append", 2, [&](ArgList args) {
+        return Value::Bool(AppendToFile(AsString(args[0]), AsString(args[1])));
+    });
+
+    // Open a file handle. mode is "r", "w" or "a"; returns a handle number or nil.
+    add("_file_open", 2, [&](ArgList args) {
+        const std::string& mode = AsString(args[1]);
+        if (mode != "r" && mode != "w" && mode != "a") throw RuntimeError("file_open() mode must be \"r\", \"w\" or \"a\"");
+        FILE* f = std::fopen(AsString(args[0]).c_str(), (mode + "b").c_str());
+        if (!f) return Value::Nil();
+        std::setvbuf(f, nullptr, _IOFBF, kFileBufferSize);
+        int handle = next_file_handle_++;
+        files_.emplace(handle, std::unique_ptr<FILE, int (*)(FILE*)>(f, &std::fclose));
+        return Value::Number(handle);
+    });
+
+    // Write a chunk to an open file handle
+    add("_file_write_chunk", 2, [&](ArgList args) {
+        FILE* f = FileHandle(args[0]);
+        const std::string& data = AsString(args[1]);
+        return Value::Bool(std::fwrite(data.data(), 1, data.size(), f) == data.size());
+    });
+
+    // Read up to N bytes from an open file handle; nil at end of file
+    add("_file_read_chunk", 2, [&](ArgList args) {
+        FILE* f = FileHandle(args[0]);
+        std::size_t n = AsByteCount(args[1]);
+        if (n == 0) return Value::Str("");
+        // Grown kFileBufferSize at a time, so a huge n costs no more than the data there is.
+        std::string chunk;
+        while (chunk.size() < n) {
+          std::size_t have = chunk.size(), want = std::min(n - have, kFileBufferSize);
+          chunk.resize(have + want);
+          std::size_t got = std::fread(&chunk[have], 1, want, f);
+          chunk.resize(have + got);
+          if (got < want) break;
+        }
+        if (chunk.empty()) return Value::Nil();
+        return Value::Str(std::move(chunk));
+    });
+
+    // Close an open file handle
+    add("_file_close", 1, [&](ArgList args) {
+        FileHandle(args[0]);
+        auto it = files_.find(static_cast<int>(AsNumber(args[0])));
+        bool ok = std::fclose(it->second.release()) == 0;
+        files_.erase(it);
+        return Value::Bool(ok);
+    });
+  }
+
+  using Clock = std::chrono::steady_clock;
+
+  struct Timer {
+    Clock::time_point due;
+    Clock::duration interval;
+    bool repeat = false;
+    Value fn;
+  };
+
+  // Schedules a callback on the event loop and returns its id.
+  int AddTimer(double ms, const Value& fn, bool repeat) {
+    if (!IsFunc(fn) && !IsNative(fn)) throw RuntimeError("Timer callback must be a function");
+    if (!(ms > 0)) ms = 0;
+    int id = next_timer_id_++;
+    Timer t;
+    t.interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(ms));
+    t.due = Clock::now() + t.interval;
+    t.repeat = repeat;
+    t.fn = fn;
+    timer_queue_.insert({t.due, id});
+    timers_.emplace(id, std::move(t));
+    return id;
+  }
+
+  // Waits for timers and readable descriptors without busy polling and dispatches their callbacks.
+  void RunLoop() {
+    if (in_loop_) throw RuntimeError("run_loop() is already running");
+    in_loop_ = true;
+    loop_stopped_ = false;
+    try {
+      while (!loop_stopped_ && (!timers_.empty() || !fd_watchers_.empty())) {
+        out_.flush();
+        int timeout = -1;
+        if (!timer_queue_.empty()) {
+          auto wait = timer_queue_.begin()->first - Clock::now();
+          auto ms = std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+          timeout = ms > 0 ? static_cast<int>(std::min<long long>(ms, 1 << 30)) : 0;
+        }
+#ifndef _WIN32
+        std::vector<pollfd> fds;
+        fds.reserve(fd_watchers_.size());
+        for (const auto& w : fd_watchers_) fds.push_back(pollfd{w.first, POLLIN, 0});
+        int n = ::poll(fds.data(), static_cast<nfds_t>(fds.size()), timeout);
+        if (n < 0 && errno != EINTR) throw RuntimeError("poll() failed");
+        for (int i = 0; n > 0 && i < static_cast<int>(fds.size()) && !loop_stopped_; i++) {
+          if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))) continue;
+          auto it = fd_watchers_.find(fds[i].fd);
+          if (it == fd_watchers_.end()) continue;
+          if (fds[i].revents & POLLNVAL) {
+            fd_watchers_.erase(it);
+            continue;
+          }
+          Value fn = it->second;
+          Call(fn, {Value::Number(fds[i].fd)});
+        }
+#else
+        if (timeout > 0) std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+#endif
+        // Only fire timers that were due before dispatch started, so a zero-interval
+        // timer cannot starve descriptor callbacks.
+        Clock::time_point now = Clock::now();
+        std::vector<int> due;
+        for (auto it = timer_queue_.begin(); it != timer_queue_.end() && it->first <= now; ++it) due.push_back(it->second);
+        for (int id : due) {
+          if (loop_stopped_) break;
+          auto it = timers_.find(id);
+          if (it == timers_.end()) continue;
+          Value fn = it->second.fn;
+          timer_queue_.erase({it->second.due, id});
+          if (it->second.repeat) {
+            it->second.due = std::max(it->second.due + it->second.interval, now);
+            timer_queue_.insert({it->second.due, id});
+          } else {
+            timers_.erase(it);
+          }
+          Call(fn, {});
+        }
+      }
+    } catch (...) {
+      in_loop_ = false;
+      throw;
+    }
+    in_loop_ = false;
+  }
+
+  // Converts a list of strings to a vector.
+  static std::vector<std::string> StringList(const Value& v) {
+    std::vector<std::string> out;
+    for (const auto& item : AsList(v)->items) out.push_back(AsString(item));
+    return out;
+  }
+
+  static Value ProcessResultValue(ProcessResult r) {
+    auto l = std::make_shared<ListValue>();
+    l->items = {Value::Number(r.exit_code), Value::Str(std::move(r.out)), Value::Str(std::move(r.err))};
+    return Value::List(l);
+  }
+
+  // Defines the legacy `input` global, which is only materialized if the script reads it.
+  void DefineInput() {
+    std::shared_ptr<InputSource> src = input_;
+    globals_->DefineLazy("input", [src]() { return Value::Str(src->ReadRest()); });
+  }
+
+#ifdef POTATOLANG_HAS_COROUTINES
+  // A suspended call to a function containing `yield`.
+  struct Generator {
+    Interpreter* interp = nullptr;
+    std::unique_ptr<Coroutine> co;
+    // The scope the body was executing in when it last yielded.
+    std::shared_ptr<Environment> env;
+    Value yielded;
+    bool running = false;
+    bool cancelled = false;
+
+    ~Generator() {
+      if (co && co->started() && !co->finished()) interp->CancelGenerator(*this);
+    }
+  };
+#endif
+
+  // Calling a generator function returns a function that resumes the body up to its next
+  // `yield` and returns the yielded value, or nil once the body has finished.
+  Value MakeGenerator(const FunctionStmt* decl, std::shared_ptr<Environment> env) {
+#ifdef POTATOLANG_HAS_COROUTINES
+    auto gen = std::make_shared<Generator>();
+    gen->interp = this;
+    gen->env = std::move(env);
+    Generator* g = gen.get();
+    gen->co = std::make_unique<Coroutine>([this, g, decl]() {
+      if (ExecuteBlock(decl->body, g->env)) return_value_ = Value();
+    });
+    auto nf = std::make_shared<NativeFunctionValue>();
+    nf->name = decl->name.lexeme;
+    nf->arity = 0;
+    nf->fn = [this, gen](ArgList) { return ResumeGenerator(*gen); };
+    return Value::Native(std::move(nf));
+#else
+    (void)decl;
+    (void)env;
+    throw RuntimeError("Generators are not supported on this platform");
+#endif
+  }
+
+#ifdef POTATOLANG_HAS_COROUTINES
+  Value ResumeGenerator(Generator& g) {
+    if (g.co->finished()) return Value::Nil();
+    if (g.running) throw RuntimeError("Generator is already running");
+    std::shared_ptr<Environment> caller_env = env_;
+    Generator* caller_gen = current_generator_;
+    env_ = g.env;
+    current_generator_ = &g;
+    g.running = true;
+    try {
+      g.co->Resume();
+    } catch (...) {
+      g.running = false;
+      env_ = caller_env;
+      current_generator_ = caller_gen;
+      throw;
+    }
+    g.running = false;
+    env_ = caller_env;
+    current_generator_ = caller_gen;
+    Value v = std::move(g.yielded);
+    g.yielded = Value::Nil();
+    return v;
+  }
+
+  // Unwinds a generator that was dropped while suspended so its frames are released.
+  void CancelGenerator(Generator& g) {
+    g.cancelled = true;
+    std::shared_ptr<Environment> caller_env = env_;
+    Generator* caller_gen = current_generator_;
+    current_generator_ = &g;
+    try {
+      g.co->Resume();
+    } catch (...) {
+    }
+    env_ = caller_env;
+    current_generator_ = caller_gen;
+  }
+#endif
+
+  // A per-thread interpreter used by par_map/par_reduce. Its output is buffered and
+  // written to the parent's streams once the parallel call finishes.
+  struct ParallelWorker {
+    std::ostringstream out;
+    std::ostringstream err;
+    std::unique_ptr<Interpreter> interp;
+  };
+
+  std::size_t ParallelWorkerCount() const {
+    if (parallel_parent_) return 1;
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Runs body over [0, count) on a pool of worker interpreters. Each worker runs under its
+  // own ParallelToken, so everything that existed before the call (scopes, lists, natives)
+  // is read-only to it and workers never write to shared state.
+  void ParallelFor(std::size_t count, std::size_t grain,
+                   const std::function<void(Interpreter&, std::size_t, std::size_t)>& body) {
+    static std::atomic<std::uint64_t> next_token{1};
+    struct TokenScope {
+      std::uint64_t saved = ParallelToken();
+      TokenScope() { ParallelToken() = next_token.fetch_add(1, std::memory_order_relaxed); }
+      ~TokenScope() { ParallelToken() = saved; }
+    };
+
+    std::size_t threads = std::min(ParallelWorkerCount(), count);
+    if (threads <= 1) {
+      // Same rules on one thread, so a script does not behave differently per machine.
+      TokenScope token;
+      if (count > 0) body(*this, 0, count);
+      return;
+    }
+    while (workers_.size() < threads) {
+      auto w = std::make_unique<ParallelWorker>();
+      w->interp = std::make_unique<Interpreter>(w->out, w->err, InputSource::FromString(""), options_);
+      w->interp->parallel_parent_ = this;
+      w->interp->limits_parent_ = this;
+      w->interp->channels_ = channels_;
+      // The worker's builtins are the ones InstallBuiltins creates, a prefix of ours.
+      for (std::size_t i = 0; i < w->interp->builtins_.size(); i++) {
+        w->interp->rebound_[builtins_[i].get()] = w->interp->builtins_[i];
+      }
+      workers_.push_back(std::move(w));
+    }
+
+    // Workers draw their steps from this interpreter's budget (see CheckLimits).
+    for (auto& w : workers_) w->interp->steps_until_check_ = 0;
+    WorkStealingRanges ranges(count, threads, grain);
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    std::mutex error_mu;
+    auto run = [&](std::size_t w) {
+      TokenScope token;
+      std::size_t begin, end;
+      try {
+        while (!failed && ranges.Next(w, begin, end)) body(*workers_[w]->interp, begin, end);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mu);
+        if (!error) error = std::current_exception();
+        failed = true;
+      }
+    };
+    std::vector<std::thread> pool;
+    for (std::size_t w = 1; w < threads; w++) pool.emplace_back(run, w);
+    run(0);
+    for (auto& t : pool) t.join();
+
+    for (std::size_t w = 0; w < threads; w++) {
+      out_ << workers_[w]->out.str();
+      err_ << workers_[w]->err.str();
+      workers_[w]->out.str("");
+      workers_[w]->err.str("");
+    }
+    if (options_.unbuffered) out_.flush();
+    if (error) std::rethrow_exception(error);
+  }
+
+  std::shared_ptr<Channel> ChannelHandle(const Value& handle) {
+    std::shared_ptr<Channel> ch = channels_->Find(static_cast<int>(AsNumber(handle)));
+    if (!ch) throw RuntimeError("Invalid channel");
+    return ch;
+  }
 
-    // Read file content
-    add("_file_read", 1, [&](const std::vector<Value>& args) {
-        std::string path = AsString(args[0]);
-        std::ifstream f(path);
-        if (!f) return Value::Nil();
-        std::ostringstream ss;
-        ss << f.rdbuf();
-        return Value::Str(ss.str());
-    });
+  // Looks up a background process handle or throws.
+  AsyncProcess* ProcessHandle(const Value& handle) {
+    auto it = processes_.find(static_cast<int>(AsNumber(handle)));
+    if (it == processes_.end()) throw RuntimeError("Invalid process handle");
+    return it->second.get();
+  }
 
-    // Write content to file
-    add("_file_write", 2, [&](const std::vector<Value>& args) {
-        std::string path = AsString(args[0]);
-        std::string content = AsString(args[1]);
-        std::ofstream f(path);
-        if (!f) return Value::Bool(false);
-        f << content;
-        return Value::Bool(true);
-    });
+  // Joins a background process, releases its handle and returns its result.
+  Value FinishProcess(const Value& handle) {
+    ProcessHandle(handle);
+    auto it = processes_.find(static_cast<int>(AsNumber(handle)));
+    std::shared_ptr<AsyncProcess> proc = std::move(it->second);
+    processes_.erase(it);
+    proc->worker.join();
+    if (!proc->error.empty()) throw RuntimeError(proc->error);
+    return ProcessResultValue(std::move(proc->result));
   }
 
-  // Imports a module from a file.
-  void ImportModule(const Token& moduleTok) {
-    std::string name = moduleTok.lexeme;
-    if (imported_modules_.find(name) != imported_modules_.end()) return;
-    imported_modules_[name] = true;
+  // Opens a file as an InputSource, reporting failure as a script error.
+  static std::shared_ptr<InputSource> OpenInput(const std::string& path) {
+    try {
+      return InputSource::Open(path);
+    } catch (const std::runtime_error& e) {
+      throw RuntimeError(e.what());
+    }
+  }
+
+  // Looks up an open file handle or throws.
+  FILE* FileHandle(const Value& handle) {
+    auto it = files_.find(static_cast<int>(AsNumber(handle)));
+    if (it == files_.end()) throw RuntimeError("Invalid file handle");
+    return it->second.get();
+  }
 
+  // A parsed module kept across Reset, with the file it came from (empty for built-in
+  // modules) and that file's modification time and size when it was read.
+  struct ModuleEntry {
+    std::shared_ptr<const CompiledProgram> program;
     std::string path;
+    std::filesystem::file_time_type mtime;
+    std::uintmax_t size = 0;
+
+    // True if the file has changed or gone away since it was parsed.
+    bool Stale() const {
+      if (path.empty()) return false;
+      std::error_code ec;
+      std::filesystem::file_time_type now = std::filesystem::last_write_time(path, ec);
+      if (ec || now != mtime) return true;
+      std::uintmax_t now_size = std::filesystem::file_size(path, ec);
+      return ec || now_size != size;
+    }
+  };
+
+  // Finds and parses a module. Paths (starting with /, ./ or ../) are read as given; bare
+  // names are looked up in options_.module_path, then among the built-in modules, then in
+  // ./potatos.
+  ModuleEntry LoadModule(const std::string& name) {
+    std::string file = name;
+    if (file.size() < 3 || file.substr(file.size() - 3) != ".pt") file += ".pt";
+    std::vector<std::string> candidates;
     if (!name.empty() && (name[0] == '/' || name.rfind("./", 0) == 0 || name.rfind("../", 0) == 0)) {
-      path = name;
+      candidates.push_back(file);
     } else {
-      path = module_base_dir_ + "/" + name;
+      for (const auto& dir : options_.module_path) candidates.push_back(dir + "/" + file);
+      if (auto entry = ReadModuleFile(name, candidates)) return std::move(*entry);
+      if (auto embedded = EmbeddedModule(file.substr(0, file.size() - 3))) return ModuleEntry{embedded, "", {}, 0};
+      candidates.assign(1, kModuleDir + std::string("/") + file);
     }
-    if (path.size() < 3 || path.substr(path.size() - 3) != ".pt") path += ".pt";
+    if (auto entry = ReadModuleFile(name, candidates)) return std::move(*entry);
+    throw RuntimeError("Failed to import module: " + name);
+  }
 
-    std::ifstream f(path);
-    if (!f) {
-      imported_modules_.erase(name);
-      throw RuntimeError("Failed to import module: " + name);
+  // Parses the first of candidates that can be read. The file is stat'ed before it is
+  // read, so an edit made in between is picked up on the next import rather than lost.
+  static std::optional<ModuleEntry> ReadModuleFile(const std::string& name, const std::vector<std::string>& candidates) {
+    for (const auto& path : candidates) {
+      ModuleEntry entry;
+      std::error_code ec;
+      entry.mtime = std::filesystem::last_write_time(path, ec);
+      if (!ec) entry.size = std::filesystem::file_size(path, ec);
+      std::string source;
+      if (ec || !ReadWholeFile(path, source)) continue;
+      entry.program = ParseModule(name, std::move(source));
+      entry.path = path;
+      return entry;
     }
+    return std::nullopt;
+  }
 
-    try {
-      std::ostringstream ss;
-      ss << f.rdbuf();
-      std::string source = ss.str();
-
-      Lexer lexer(std::move(source));
-      std::vector<Token> tokens = lexer.LexAll();
-      for (const auto& t : tokens) {
-        if (t.type == TokenType::Invalid) {
-          throw RuntimeError("Lex error importing module: " + name);
-        }
+  static std::shared_ptr<const CompiledProgram> ParseModule(const std::string& name, std::string source) {
+    Lexer lexer(std::move(source));
+    std::vector<Token> tokens = lexer.LexAll();
+    for (const auto& t : tokens) {
+      if (t.type == TokenType::Invalid) {
+        throw RuntimeError("Lex error importing module: " + name);
       }
+    }
+    Parser parser(std::move(tokens));
+    return CompiledProgram::FromStatements(parser.ParseProgram());
+  }
+
+  // Imports a module and runs it in the global scope.
+  void ImportModule(const Token& moduleTok) {
+    std::string name = moduleTok.lexeme;
+    if (imported_modules_.find(name) != imported_modules_.end()) return;
+    imported_modules_[name] = true;
 
-      Parser parser(std::move(tokens));
-      std::vector<StmtPtr> program = parser.ParseProgram();
-      imported_programs_[name] = std::move(program);
-      const std::vector<StmtPtr>& kept = imported_programs_[name];
+    try {
+      // Modules parsed before a Reset are re-executed from their cached AST, unless the
+      // file has been edited since.
+      auto cached = imported_programs_.find(name);
+      if (cached != imported_programs_.end() && cached->second.Stale()) {
+        imported_programs_.erase(cached);
+        cached = imported_programs_.end();
+      }
+      if (cached == imported_programs_.end()) cached = imported_programs_.emplace(name, LoadModule(name)).first;
+      const std::vector<StmtPtr>& kept = cached->second.program->statements();
 
       std::shared_ptr<Environment> previous = env_;
       env_ = globals_;
       try {
-        for (const auto& s : kept) Execute(s.get());
+        for (const auto& s : kept) {
+          if (Execute(s.get())) break;
+        }
       } catch (...) {
         env_ = previous;
         throw;
@@ -1453,80 +5241,102 @@ class Interpreter {
     }
   }
 
-  // Executes a single statement.
-  void Execute(const Stmt* stmt) {
+  // Executes a single statement. Returns true if a `return` ran, with its value left in
+  // return_value_; returning is a plain flag rather than an exception so calls stay cheap.
+  bool Execute(const Stmt* stmt) {
     if (auto s = dynamic_cast<const ImportStmt*>(stmt)) {
       ImportModule(s->module);
-      return;
+      return false;
     }
     if (auto s = dynamic_cast<const LetStmt*>(stmt)) {
       Value v = Evaluate(s->init.get());
-      env_->Define(s->name.lexeme, std::move(v));
-      return;
+      env_->DefineLocal(s->name.lexeme, std::move(v));
+      return false;
     }
     if (auto s = dynamic_cast<const AssignStmt*>(stmt)) {
       Value v = Evaluate(s->value.get());
       env_->Assign(s->name, std::move(v));
-      return;
+      return false;
     }
     if (auto s = dynamic_cast<const PrintStmt*>(stmt)) {
       Value v = Evaluate(s->expr.get());
       out_ << ValueToString(v) << "\n";
-      return;
+      if (options_.unbuffered) out_.flush();
+      return false;
     }
     if (auto s = dynamic_cast<const ExprStmt*>(stmt)) {
       (void)Evaluate(s->expr.get());
-      return;
+      return false;
     }
     if (auto s = dynamic_cast<const BlockStmt*>(stmt)) {
-      ExecuteBlock(s->statements, std::make_shared<Environment>(env_));
-      return;
+      return ExecuteBlock(s->statements, Environment::Make(env_));
     }
     if (auto s = dynamic_cast<const IfStmt*>(stmt)) {
-      if (IsTruthy(Evaluate(s->condition.get()))) {
-        Execute(s->thenBranch.get());
-      } else if (s->elseBranch.has_value()) {
-        Execute((*s->elseBranch).get());
-      }
-      return;
+      if (IsTruthy(Evaluate(s->condition.get()))) return Execute(s->thenBranch.get());
+      if (s->elseBranch.has_value()) return Execute((*s->elseBranch).get());
+      return false;
     }
     if (auto s = dynamic_cast<const WhileStmt*>(stmt)) {
-      while (IsTruthy(Evaluate(s->condition.get()))) Execute(s->body.get());
-      return;
+      while (IsTruthy(Evaluate(s->condition.get()))) {
+        Step();
+        if (Execute(s->body.get())) return true;
+      }
+      return false;
     }
     if (auto s = dynamic_cast<const FunctionStmt*>(stmt)) {
       auto f = std::make_shared<FunctionValue>();
       f->decl = s;
       f->closure = env_;
-      env_->Define(s->name.lexeme, Value::Func(std::move(f)));
-      return;
+      env_->DefineLocal(s->name.lexeme, Value::Func(std::move(f)));
+      return false;
     }
     if (auto s = dynamic_cast<const ReturnStmt*>(stmt)) {
+      return_value_ = s->value.has_value() ? Evaluate((*s->value).get()) : Value::Nil();
+      return true;
+    }
+    if (auto s = dynamic_cast<const YieldStmt*>(stmt)) {
       Value v = Value::Nil();
       if (s->value.has_value()) v = Evaluate((*s->value).get());
-      throw ReturnSignal{std::move(v)};
+#ifdef POTATOLANG_HAS_COROUTINES
+      Generator* g = current_generator_;
+      // The parser only accepts `yield` in functions, but decoded ASTs are not parsed.
+      if (!g) throw RuntimeError("'yield' outside of a generator");
+      g->yielded = std::move(v);
+      g->env = env_;
+      g->co->Yield();
+      if (g->cancelled) throw GeneratorExit{};
+      return false;
+#else
+      throw RuntimeError("Generators are not supported on this platform");
+#endif
     }
     throw RuntimeError("Unknown statement");
   }
 
-  // Executes a block of statements in a new environment.
-  void ExecuteBlock(const std::vector<StmtPtr>& statements, std::shared_ptr<Environment> newEnv) {
-    std::shared_ptr<Environment> previous = env_;
+  // Executes a block of statements in a new environment. Returns true if a `return` ran.
+  bool ExecuteBlock(const std::vector<StmtPtr>& statements, std::shared_ptr<Environment> newEnv) {
+    std::shared_ptr<Environment> previous = std::move(env_);
     env_ = std::move(newEnv);
     try {
-      for (const auto& s : statements) Execute(s.get());
+      for (const auto& s : statements) {
+        if (Execute(s.get())) {
+          env_ = std::move(previous);
+          return true;
+        }
+      }
     } catch (...) {
-      env_ = previous;
+      env_ = std::move(previous);
       throw;
     }
-    env_ = previous;
+    env_ = std::move(previous);
+    return false;
   }
 
   // Evaluates an expression and returns a value.
   Value Evaluate(const Expr* expr) {
     if (auto e = dynamic_cast<const LiteralExpr*>(expr)) {
       switch (e->kind) {
-        case LiteralExpr::Kind::Number: return Value::Number(std::strtod(e->value.c_str(), nullptr));
+        case LiteralExpr::Kind::Number: return Value::Number(e->number);
         case LiteralExpr::Kind::String: return Value::Str(e->value);
         case LiteralExpr::Kind::Bool: return Value::Bool(e->value == "true");
         case LiteralExpr::Kind::Nil: return Value::Nil();
@@ -1535,6 +5345,8 @@ class Interpreter {
     if (auto e = dynamic_cast<const VariableExpr*>(expr)) return env_->Get(e->name);
     if (auto e = dynamic_cast<const GroupingExpr*>(expr)) return Evaluate(e->expr.get());
     if (auto e = dynamic_cast<const UnaryExpr*>(expr)) {
+      double x;
+      if (e->numeric && e->op.type == TokenType::Minus && EvaluateNumber(e->right.get(), x)) return Value::Number(-x);
       Value right = Evaluate(e->right.get());
       if (e->op.type == TokenType::Minus) {
         return Value::Number(-AsNumber(right));
@@ -1555,6 +5367,22 @@ class Interpreter {
       throw RuntimeError("Unknown logical operator");
     }
     if (auto e = dynamic_cast<const BinaryExpr*>(expr)) {
+      double l, r;
+      if (e->numeric && EvaluateNumber(e->left.get(), l) && EvaluateNumber(e->right.get(), r)) {
+        switch (e->op.type) {
+          case TokenType::Plus: return Value::Number(l + r);
+          case TokenType::Minus: return Value::Number(l - r);
+          case TokenType::Star: return Value::Number(l * r);
+          case TokenType::Slash: return Value::Number(l / r);
+          case TokenType::Greater: return Value::Bool(l > r);
+          case TokenType::GreaterEqual: return Value::Bool(l >= r);
+          case TokenType::Less: return Value::Bool(l < r);
+          case TokenType::LessEqual: return Value::Bool(l <= r);
+          case TokenType::EqualEqual: return Value::Bool(l == r);
+          case TokenType::BangEqual: return Value::Bool(l != r);
+          default: break;
+        }
+      }
       Value left = Evaluate(e->left.get());
       Value right = Evaluate(e->right.get());
       switch (e->op.type) {
@@ -1586,62 +5414,320 @@ class Interpreter {
     }
     if (auto e = dynamic_cast<const CallExpr*>(expr)) {
       Value callee = Evaluate(e->callee.get());
-      std::vector<Value> args;
-      args.reserve(e->args.size());
-      for (const auto& a : e->args) args.push_back(Evaluate(a.get()));
-      return Call(std::move(callee), args);
+      ValueStack::Frame frame(stack_, e->args.size());
+      for (std::size_t i = 0; i < frame.size(); i++) frame[i] = Evaluate(e->args[i].get());
+      if (IsFunc(callee)) return CallFunction(*std::get<std::shared_ptr<FunctionValue>>(callee.v), frame);
+      return Call(callee, frame.args());
     }
     throw RuntimeError("Unknown expression");
   }
 
+  // Evaluates an expression that InferTypes found to be numeric straight to a double,
+  // without building intermediate Values. Only side-effect-free nodes qualify, so when a
+  // variable turns out not to hold a number this returns false and the caller can simply
+  // evaluate the same expression again with Evaluate.
+  bool EvaluateNumber(const Expr* expr, double& out) {
+    if (auto e = dynamic_cast<const VariableExpr*>(expr)) return env_->GetNumber(e->name, out);
+    if (auto e = dynamic_cast<const LiteralExpr*>(expr)) {
+      out = e->number;
+      return e->kind == LiteralExpr::Kind::Number;
+    }
+    if (auto e = dynamic_cast<const BinaryExpr*>(expr)) {
+      double l, r;
+      if (!e->numeric || !EvaluateNumber(e->left.get(), l) || !EvaluateNumber(e->right.get(), r)) return false;
+      switch (e->op.type) {
+        case TokenType::Plus: out = l + r; return true;
+        case TokenType::Minus: out = l - r; return true;
+        case TokenType::Star: out = l * r; return true;
+        case TokenType::Slash: out = l / r; return true;
+        default: return false;
+      }
+    }
+    if (auto e = dynamic_cast<const GroupingExpr*>(expr)) return EvaluateNumber(e->expr.get(), out);
+    if (auto e = dynamic_cast<const UnaryExpr*>(expr)) {
+      if (!e->numeric || e->op.type != TokenType::Minus || !EvaluateNumber(e->right.get(), out)) return false;
+      out = -out;
+      return true;
+    }
+    return false;
+  }
+
   // Calls a function (native or user-defined).
-  Value Call(Value callee, const std::vector<Value>& args) {
+  Value Call(const Value& callee, ArgList args) {
     if (IsNative(callee)) {
-      auto nf = std::get<std::shared_ptr<NativeFunctionValue>>(callee.v);
+      const NativeFunctionValue* nf = std::get<std::shared_ptr<NativeFunctionValue>>(callee.v).get();
+      // Other natives (generators, iterators, embedder callbacks) carry the state of the
+      // interpreter that made them, so a parallel worker may only call its own.
+      if (ParallelToken() != 0 && !nf->builtin && nf->owner != ParallelToken()) {
+        throw RuntimeError("Cannot call " + nf->name + " inside a parallel worker");
+      }
+      if (!rebound_.empty()) {
+        // Builtins of the parent interpreter run against this worker's own state.
+        auto it = rebound_.find(nf);
+        if (it != rebound_.end()) nf = it->second.get();
+      }
       if (nf->arity >= 0 && static_cast<int>(args.size()) != nf->arity) {
         throw RuntimeError("Arity mismatch calling " + nf->name);
       }
+      if (nf->invoke) return nf->invoke(nf->target, args.data());
       return nf->fn(args);
     }
     if (IsFunc(callee)) {
-      auto f = std::get<std::shared_ptr<FunctionValue>>(callee.v);
-      const FunctionStmt* decl = f->decl;
-      if (static_cast<int>(args.size()) != static_cast<int>(decl->params.size())) {
-        throw RuntimeError("Arity mismatch calling " + decl->name.lexeme);
-      }
-      auto callEnv = std::make_shared<Environment>(f->closure);
-      for (std::size_t i = 0; i < decl->params.size(); i++) {
-        callEnv->Define(decl->params[i].lexeme, args[i]);
-      }
-      try {
-        ExecuteBlock(decl->body, std::move(callEnv));
-      } catch (const ReturnSignal& r) {
-        return r.value;
-      }
-      return Value::Nil();
+      ValueStack::Frame frame(stack_, args.size());
+      for (std::size_t i = 0; i < frame.size(); i++) frame[i] = args[i];
+      return CallFunction(*std::get<std::shared_ptr<FunctionValue>>(callee.v), frame);
     }
     throw RuntimeError("Can only call functions");
   }
 
+  Value Call(const Value& callee, std::initializer_list<Value> args) {
+    return Call(callee, ArgList(args.begin(), args.size()));
+  }
+
+  // Marks the snapshot's modules as imported and defines its globals. Functions run the
+  // snapshot's own ASTs; values are decoded afresh so interpreters never share lists.
+  void RestoreSnapshot(const Snapshot& snapshot) {
+    for (const auto& m : snapshot.modules()) imported_modules_[m.name] = true;
+    std::shared_ptr<ListValue> values = snapshot.values();
+    std::size_t next_value = 0;
+    for (const auto& g : snapshot.globals()) {
+      switch (g.kind) {
+        case Snapshot::Global::Kind::Value:
+          if (next_value >= values->items.size()) AstReader::Corrupt();
+          globals_->Define(g.name, std::move(values->items[next_value++]));
+          break;
+        case Snapshot::Global::Kind::Function: {
+          auto f = std::make_shared<FunctionValue>();
+          f->decl = g.function;
+          f->closure = globals_;
+          globals_->Define(g.name, Value::Func(std::move(f)));
+          break;
+        }
+        case Snapshot::Global::Kind::Builtin: {
+          auto it = std::find_if(builtins_.begin(), builtins_.end(),
+                                 [&](const std::shared_ptr<NativeFunctionValue>& nf) { return nf->name == g.builtin; });
+          if (it == builtins_.end()) throw RuntimeError("Snapshot refers to unknown builtin: " + g.builtin);
+          globals_->Define(g.name, Value::Native(*it));
+          break;
+        }
+      }
+    }
+  }
+
+  static constexpr std::int64_t kStepCheckInterval = 1024;
+
+  // Charged once per loop iteration and function call. Only every kStepCheckInterval-th
+  // step (or the last one of the budget) takes the branch into CheckLimits.
+  void Step() {
+    if (--steps_until_check_ < 0) CheckLimits();
+  }
+
+  // Throws if this interpreter or any that started it was cancelled, or the deadline of
+  // the outermost one has passed. Returns that outermost interpreter.
+  Interpreter* CheckCancelled() {
+    Interpreter* root = this;
+    for (Interpreter* p = this; p; p = p->limits_parent_) {
+      if (p->cancel_requested_.load(std::memory_order_relaxed)) throw RuntimeError("Script cancelled");
+      root = p;
+    }
+    std::int64_t deadline = root->deadline_.load(std::memory_order_relaxed);
+    if (deadline != kNoDeadline && Clock::now().time_since_epoch().count() >= deadline) {
+      throw RuntimeError("Time limit exceeded");
+    }
+    return root;
+  }
+
+  // Checks cancellation and the deadline, then hands out the next slice of the step
+  // budget. Parallel workers and isolates draw on the budget of the outermost interpreter.
+  void CheckLimits() {
+    Interpreter* root = CheckCancelled();
+    std::int64_t slice = kStepCheckInterval;
+    if (options_.max_steps > 0) {
+      std::uint64_t left = root->steps_left_.load(std::memory_order_relaxed);
+      do {
+        if (left == 0) throw RuntimeError("Step limit exceeded");
+        slice = static_cast<std::int64_t>(std::min<std::uint64_t>(left, kStepCheckInterval));
+      } while (!root->steps_left_.compare_exchange_weak(left, left - static_cast<std::uint64_t>(slice),
+                                                         std::memory_order_relaxed));
+    }
+    steps_until_check_ = slice - 1;
+  }
+
+  // Cancels and joins the isolates that are still running, so a script that never calls
+  // isolate_join cannot keep its interpreter from shutting down.
+  void StopIsolates() {
+    bool running = false;
+    for (auto& iso : isolates_) running = running || iso.second->worker.joinable();
+    if (!running) return;
+    cancel_requested_ = true;
+    for (auto& iso : isolates_) {
+      if (iso.second->worker.joinable()) iso.second->worker.join();
+    }
+  }
+
+  // Restarts the step budget and the deadline.
+  void StartLimits() {
+    steps_left_ = options_.max_steps;
+    steps_until_check_ = 0;
+    deadline_ = options_.time_limit.count() > 0
+                    ? (Clock::now() + options_.time_limit).time_since_epoch().count()
+                    : kNoDeadline;
+  }
+
+  // Calls a user function, moving its arguments out of frame into the new scope.
+  Value CallFunction(const FunctionValue& f, ValueStack::Frame& frame) {
+    const FunctionStmt* decl = f.decl;
+    if (frame.size() != decl->params.size()) {
+      throw RuntimeError("Arity mismatch calling " + decl->name.lexeme);
+    }
+    Step();
+#ifdef POTATOLANG_HAS_COROUTINES
+    if (current_generator_ && current_generator_->co->StackLow()) {
+      throw RuntimeError("Stack overflow: recursion too deep inside a generator");
+    }
+#endif
+    auto callEnv = Environment::Make(f.closure);
+    for (std::size_t i = 0; i < decl->params.size(); i++) {
+      callEnv->DefineLocal(decl->params[i].lexeme, std::move(frame[i]));
+    }
+    if (decl->is_generator) return MakeGenerator(decl, std::move(callEnv));
+    if (ExecuteBlock(decl->body, std::move(callEnv))) return std::move(return_value_);
+    return Value::Nil();
+  }
+
   std::ostream& out_;
   std::ostream& err_;
+  InterpreterOptions options_;
   std::shared_ptr<Environment> globals_;
   std::shared_ptr<Environment> env_;
   std::unordered_map<std::string, bool> imported_modules_;
-  std::unordered_map<std::string, std::vector<StmtPtr>> imported_programs_;
-  std::string module_base_dir_ = "potatos";
+  std::unordered_map<std::string, ModuleEntry> imported_programs_;
+  static constexpr const char* kModuleDir = "potatos";
+  std::shared_ptr<InputSource> input_;
+  static constexpr std::size_t kFileBufferSize = 1 << 16;
+  std::unordered_map<int, std::unique_ptr<FILE, int (*)(FILE*)>> files_;
+  int next_file_handle_ = 1;
+  std::unordered_map<int, Timer> timers_;
+  std::set<std::pair<Clock::time_point, int>> timer_queue_;
+  std::unordered_map<int, Value> fd_watchers_;
+  int next_timer_id_ = 1;
+  std::unordered_map<int, std::shared_ptr<AsyncProcess>> processes_;
+  int next_process_handle_ = 1;
+  bool in_loop_ = false;
+  bool loop_stopped_ = false;
+  std::unordered_map<int, std::shared_ptr<Isolate>> isolates_;
+  int next_isolate_handle_ = 1;
+  std::shared_ptr<ChannelTable> channels_ = std::make_shared<ChannelTable>();
+  std::mt19937 rng_{std::random_device{}()};
+  SDL_Window* window_ = nullptr;
+  SDL_Renderer* renderer_ = nullptr;
+  std::vector<std::shared_ptr<NativeFunctionValue>> builtins_;
+  std::vector<std::unique_ptr<ParallelWorker>> workers_;
+  Interpreter* parallel_parent_ = nullptr;
+  // The par_map caller or isolate spawner whose limits and cancellation also apply here.
+  Interpreter* limits_parent_ = nullptr;
+  std::unordered_map<const NativeFunctionValue*, std::shared_ptr<NativeFunctionValue>> rebound_;
+  std::shared_ptr<const CompiledProgram> program_;
+  ValueStack stack_;
+  // Value of the `return` that is unwinding the current call.
+  Value return_value_;
+  std::int64_t steps_until_check_ = 0;
+  std::atomic<std::uint64_t> steps_left_{0};
+  // Clock ticks, atomic because isolates read the deadline of the interpreter that
+  // spawned them (see CheckCancelled).
+  static constexpr std::int64_t kNoDeadline = INT64_MAX;
+  std::atomic<std::int64_t> deadline_{kNoDeadline};
+  std::atomic<bool> cancel_requested_{false};
+#ifdef POTATOLANG_HAS_COROUTINES
+  Generator* current_generator_ = nullptr;
+#endif
+};
+
+// A thread-safe pool of interpreters that all run the same compiled program. Each Run
+// takes an idle interpreter (creating one only when all are busy), resets it, and points
+// it at the caller's streams, so steady-state requests skip lexing, parsing and builtin
+// installation entirely.
+class InterpreterPool {
+ public:
+  // setup, if given, runs once on each interpreter the pool creates (e.g. to Register natives).
+  explicit InterpreterPool(std::shared_ptr<const CompiledProgram> program, InterpreterOptions options = {},
+                           std::function<void(Interpreter&)> setup = nullptr)
+      : program_(std::move(program)), options_(options), setup_(std::move(setup)) {}
+
+  int Run(std::shared_ptr<InputSource> input, std::ostream& out, std::ostream& err) {
+    std::unique_ptr<Slot> slot = Acquire();
+    slot->out.rdbuf(out.rdbuf());
+    slot->err.rdbuf(err.rdbuf());
+    slot->out.clear();
+    slot->err.clear();
+    if (slot->interp) {
+      slot->interp->Reset(std::move(input));
+    } else {
+      slot->interp = std::make_unique<Interpreter>(slot->out, slot->err, std::move(input), options_);
+      if (setup_) setup_(*slot->interp);
+    }
+    int code = slot->interp->Run(program_);
+    slot->out.flush();
+    slot->err.flush();
+    slot->out.rdbuf(nullptr);
+    slot->err.rdbuf(nullptr);
+    Release(std::move(slot));
+    return code;
+  }
+
+  int Run(const std::string& input, std::ostream& out, std::ostream& err) {
+    return Run(InputSource::FromString(input), out, err);
+  }
+
+  // Number of interpreters created so far (the peak number of concurrent runs).
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return created_;
+  }
+
+ private:
+  // The interpreter writes through these proxy streams, which are attached to the
+  // caller's stream buffers for the duration of one run.
+  struct Slot {
+    std::ostream out{nullptr};
+    std::ostream err{nullptr};
+    std::unique_ptr<Interpreter> interp;
+  };
+
+  std::unique_ptr<Slot> Acquire() {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (idle_.empty()) {
+      created_++;
+      return std::make_unique<Slot>();
+    }
+    std::unique_ptr<Slot> slot = std::move(idle_.back());
+    idle_.pop_back();
+    return slot;
+  }
+
+  void Release(std::unique_ptr<Slot> slot) {
+    std::lock_guard<std::mutex> lock(mu_);
+    idle_.push_back(std::move(slot));
+  }
+
+  std::shared_ptr<const CompiledProgram> program_;
+  InterpreterOptions options_;
+  std::function<void(Interpreter&)> setup_;
+  mutable std::mutex mu_;
+  std::vector<std::unique_ptr<Slot>> idle_;
+  std::size_t created_ = 0;
 };
 
-static std::string ReadAll(std::istream& in) {
+inline std::string ReadAll(std::istream& in) {
   std::ostringstream ss;
   ss << in.rdbuf();
   return ss.str();
 }
 
-static std::string ReadFile(const std::string& path) {
-  std::ifstream f(path);
-  if (!f) throw std::runtime_error("Failed to open file: " + path);
-  return ReadAll(f);
+inline std::string ReadFile(const std::string& path) {
+  std::string content;
+  if (!ReadWholeFile(path, content)) throw std::runtime_error("Failed to open file: " + path);
+  return content;
 }
 
 inline int ParseOnly(const std::string& source, std::ostream& out, std::ostream& err) {
@@ -1670,25 +5756,486 @@ inline int ParseOnly(const std::string& source, std::ostream& out, std::ostream&
   }
 }
 
-static int RunScript(const std::string& scriptSource, const std::string& input, std::ostream& out, std::ostream& err) {
-  Lexer lexer(scriptSource);
-  std::vector<Token> tokens = lexer.LexAll();
-  for (const auto& t : tokens) {
-    if (t.type == TokenType::Invalid) {
-      err << "Lex error at " << t.loc.line << ":" << t.loc.column << ": " << t.lexeme << "\n";
-      return 1;
-    }
+// Prints what InferTypes worked out for each variable binding, assignment and read, one
+// per line in source order, for --dump-types.
+inline int DumpTypes(const std::string& source, std::ostream& out, std::ostream& err) {
+  std::vector<StmtPtr> program;
+  if (!CompileSource(source, program, err)) return 1;
+  std::vector<TypeRecord> records;
+  InferTypes(program, &records);
+  for (const auto& r : records) {
+    out << r.loc.line << ":" << r.loc.column << " " << r.kind << " " << r.name << ": " << TypeSetName(r.type) << "\n";
+  }
+  return 0;
+}
+
+inline int RunScript(const std::string& scriptSource, std::shared_ptr<InputSource> input, std::ostream& out,
+                     std::ostream& err, InterpreterOptions options = {}) {
+  std::shared_ptr<const CompiledProgram> program = CompiledProgram::Compile(scriptSource, err);
+  if (!program) return 1;
+  Interpreter interp(out, err, std::move(input), options);
+  return interp.Run(std::move(program));
+}
+
+inline int RunScript(const std::string& scriptSource, const std::string& input, std::ostream& out, std::ostream& err) {
+  return RunScript(scriptSource, InputSource::FromString(input), out, err);
+}
+
+// The modules --make-snapshot preloads when none are named.
+inline const std::vector<std::string>& DefaultSnapshotModules() {
+  static const std::vector<std::string> kModules = {"pio", "potato_file", "potato_ui"};
+  return kModules;
+}
+
+// Imports modules into a fresh interpreter and writes its state to path for --snapshot.
+inline int MakeSnapshot(const std::vector<std::string>& modules, const std::string& path, std::ostream& err) {
+  std::string source;
+  for (const auto& m : modules) source += "import \"" + LiteralExpr::Escape(m) + "\";\n";
+  std::shared_ptr<const CompiledProgram> program = CompiledProgram::Compile(source, err);
+  if (!program) return 1;
+  std::ostringstream out;
+  Interpreter interp(out, err, InputSource::FromString(""));
+  if (interp.Run(program) != 0) return 1;
+  // Restoring a snapshot does not run the modules again, so this output would be lost.
+  if (!out.str().empty()) {
+    err << "Warning: the modules printed output while being imported; it is not repeated when the snapshot "
+           "is loaded\n";
   }
+  std::string blob;
   try {
-    Parser parser(std::move(tokens));
-    std::vector<StmtPtr> program = parser.ParseProgram();
-    Interpreter interp(out, err, input);
-    return interp.Run(program);
-  } catch (const ParseError& e) {
+    blob = interp.EncodeSnapshot();
+  } catch (const RuntimeError& e) {
     err << e.what() << "\n";
     return 1;
   }
+  std::ofstream f(path, std::ios::binary | std::ios::trunc);
+  if (!f.write(blob.data(), static_cast<std::streamsize>(blob.size())) || !f.flush()) {
+    err << "Failed to write snapshot: " << path << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+// Expands a --batch argument into input paths: every regular file in a directory (sorted
+// by name), or otherwise one path per non-empty line of a list file.
+inline std::vector<std::string> ListBatchInputs(const std::string& spec) {
+  std::vector<std::string> inputs;
+  std::error_code ec;
+  if (std::filesystem::is_directory(spec, ec)) {
+    for (const auto& entry : std::filesystem::directory_iterator(spec)) {
+      if (entry.is_regular_file()) inputs.push_back(entry.path().string());
+    }
+    std::sort(inputs.begin(), inputs.end());
+    return inputs;
+  }
+  std::string list;
+  if (!ReadWholeFile(spec, list)) throw std::runtime_error("Failed to open file: " + spec);
+  std::istringstream lines(list);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (!line.empty()) inputs.push_back(line);
+  }
+  return inputs;
+}
+
+// Runs one script over many inputs on `jobs` threads, parsing it only once. Each input gets
+// its own interpreter state. With an out_dir, input `a/b.txt` writes `out_dir/b.txt`;
+// otherwise outputs are written to out in input order. Errors are reported to err in input
+// order, prefixed with the input path. Returns 0 if every input succeeded.
+inline int RunBatch(const std::string& scriptSource, const std::vector<std::string>& inputs, unsigned jobs,
+                    const std::string& out_dir, std::ostream& out, std::ostream& err, InterpreterOptions options = {}) {
+  std::shared_ptr<const CompiledProgram> program = CompiledProgram::Compile(scriptSource, err);
+  if (!program) return 1;
+
+  std::vector<std::string> out_paths;
+  if (!out_dir.empty()) {
+    std::error_code ec;
+    std::filesystem::create_directories(out_dir, ec);
+    std::unordered_map<std::string, std::size_t> seen;
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+      std::string name = std::filesystem::path(inputs[i]).filename().string();
+      auto it = seen.emplace(name, i);
+      if (!it.second) {
+        err << "Batch inputs " << inputs[it.first->second] << " and " << inputs[i] << " would both write " << name
+            << "\n";
+        return 1;
+      }
+      out_paths.push_back((std::filesystem::path(out_dir) / name).string());
+    }
+  }
+
+  struct Result {
+    std::string out;
+    std::string err;
+    int code = 0;
+    bool done = false;
+  };
+  std::vector<Result> results(inputs.size());
+  std::mutex mu;
+  std::condition_variable finished;
+  std::atomic<std::size_t> next{0};
+  InterpreterPool pool(program, options);
+
+  auto worker = [&]() {
+    while (true) {
+      std::size_t i = next++;
+      if (i >= inputs.size()) return;
+      std::ostringstream script_out, script_err;
+      std::ofstream file_out;
+      std::ostream* dest = &script_out;
+      int code = 1;
+      try {
+        if (!out_paths.empty()) {
+          file_out.open(out_paths[i], std::ios::binary | std::ios::trunc);
+          if (!file_out) throw std::runtime_error("Failed to open file: " + out_paths[i]);
+          dest = &file_out;
+        }
+        code = pool.Run(InputSource::Open(inputs[i]), *dest, script_err);
+        if (file_out.is_open()) {
+          file_out.close();
+          if (!file_out) throw std::runtime_error("Failed to write file: " + out_paths[i]);
+        }
+      } catch (const std::exception& e) {
+        script_err << e.what() << "\n";
+        code = 1;
+      }
+      std::lock_guard<std::mutex> lock(mu);
+      results[i].out = script_out.str();
+      results[i].err = script_err.str();
+      results[i].code = code;
+      results[i].done = true;
+      finished.notify_one();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < std::max(1u, jobs); t++) threads.emplace_back(worker);
+
+  // Emit results in input order as soon as each prefix of inputs is complete.
+  std::size_t failed = 0;
+  for (std::size_t i = 0; i < results.size(); i++) {
+    Result r;
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      finished.wait(lock, [&] { return results[i].done; });
+      r = std::move(results[i]);
+    }
+    out << r.out;
+    std::istringstream lines(r.err);
+    std::string line;
+    while (std::getline(lines, line)) err << inputs[i] << ": " << line << "\n";
+    if (r.code != 0) failed++;
+  }
+  for (auto& t : threads) t.join();
+  out.flush();
+  if (failed > 0) err << failed << " of " << inputs.size() << " inputs failed\n";
+  return failed > 0 ? 1 : 0;
+}
+
+#ifndef _WIN32
+// Server mode (--serve / --client).
+//
+// A request is the script's absolute path as a 4-byte little-endian length followed by
+// the bytes, then the script's input as a raw stream up to the client's write shutdown.
+// The server answers with frames of a 1-byte tag ('o' stdout, 'e' stderr, 'x' exit code),
+// a 4-byte little-endian length, and the payload; 'x' carries the exit code as 4 bytes.
+
+static bool SendAll(int fd, const char* data, std::size_t n) {
+  while (n > 0) {
+    ssize_t w = WriteNoSigpipe(fd, data, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    data += w;
+    n -= static_cast<std::size_t>(w);
+  }
+  return true;
+}
+
+static bool RecvAll(int fd, char* data, std::size_t n) {
+  while (n > 0) {
+    ssize_t r = ::recv(fd, data, n, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    data += r;
+    n -= static_cast<std::size_t>(r);
+  }
+  return true;
+}
+
+static void PutU32(char* p, std::uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+static std::uint32_t GetU32(const char* p) {
+  std::uint32_t v = 0;
+  for (int i = 0; i < 4; i++) v |= static_cast<std::uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+  return v;
+}
+
+static bool SendFrame(int fd, char tag, const char* data, std::size_t n) {
+  char header[5];
+  header[0] = tag;
+  PutU32(header + 1, static_cast<std::uint32_t>(n));
+  return SendAll(fd, header, sizeof header) && SendAll(fd, data, n);
+}
+
+// Buffers interpreter output and sends it to the client as frames with one tag.
+class FrameStreamBuf : public std::streambuf {
+ public:
+  FrameStreamBuf(int fd, char tag) : fd_(fd), tag_(tag), buffer_(1 << 16) {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+  ~FrameStreamBuf() override { sync(); }
+
+ protected:
+  int_type overflow(int_type ch) override {
+    if (sync() != 0) return traits_type::eof();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  int sync() override {
+    std::size_t n = static_cast<std::size_t>(pptr() - pbase());
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    if (n > 0 && !SendFrame(fd_, tag_, pbase(), n)) return -1;
+    return 0;
+  }
+
+ private:
+  int fd_;
+  char tag_;
+  std::vector<char> buffer_;
+};
+
+// Keeps one InterpreterPool per script, recompiling when the file's mtime or size changes.
+class ScriptCache {
+ public:
+  explicit ScriptCache(InterpreterOptions options = {}) : options_(std::move(options)) {}
+
+  // Returns nullptr and writes the error to err if the script cannot be read or compiled.
+  std::shared_ptr<InterpreterPool> Get(const std::string& path, std::ostream& err) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+      err << "Failed to open file: " << path << "\n";
+      return nullptr;
+    }
+#ifdef __APPLE__
+    const timespec mtime = st.st_mtimespec;
+#else
+    const timespec mtime = st.st_mtim;
+#endif
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto it = entries_.find(path);
+      if (it != entries_.end() && it->second.mtime_sec == mtime.tv_sec && it->second.mtime_nsec == mtime.tv_nsec &&
+          it->second.size == st.st_size) {
+        return it->second.pool;
+      }
+    }
+    std::string source;
+    if (!ReadWholeFile(path, source)) {
+      err << "Failed to open file: " << path << "\n";
+      return nullptr;
+    }
+    std::shared_ptr<const CompiledProgram> program = CompiledProgram::Compile(source, err);
+    if (!program) return nullptr;
+    auto pool = std::make_shared<InterpreterPool>(std::move(program), options_);
+    std::lock_guard<std::mutex> lock(mu_);
+    entries_[path] = Entry{mtime.tv_sec, mtime.tv_nsec, st.st_size, pool};
+    return pool;
+  }
+
+ private:
+  struct Entry {
+    time_t mtime_sec;
+    long mtime_nsec;
+    off_t size;
+    std::shared_ptr<InterpreterPool> pool;
+  };
+
+  InterpreterOptions options_;
+  std::mutex mu_;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+static void ServeConnection(int conn, ScriptCache& cache) {
+  char len_buf[4];
+  std::string path;
+  if (RecvAll(conn, len_buf, 4)) {
+    // The length comes from the client; anything longer than a path can be is refused
+    // before it is used to size a buffer.
+    std::uint32_t len = GetU32(len_buf);
+    if (len == 0 || len > PATH_MAX) {
+      static const char kBadPath[] = "Invalid script path length\n";
+      SendFrame(conn, 'e', kBadPath, sizeof kBadPath - 1);
+      char code_buf[4];
+      PutU32(code_buf, 1);
+      SendFrame(conn, 'x', code_buf, 4);
+      return;
+    }
+    path.resize(len);
+    if (!RecvAll(conn, &path[0], path.size())) path.clear();
+  }
+  if (path.empty()) return;
+
+  int code = 1;
+  {
+    FrameStreamBuf out_buf(conn, 'o'), err_buf(conn, 'e');
+    std::ostream out(&out_buf), err(&err_buf);
+    // One bad request must not take the server down with it.
+    try {
+      if (std::shared_ptr<InterpreterPool> pool = cache.Get(path, err)) {
+        code = pool->Run(InputSource::FromFd(conn, false), out, err);
+      }
+    } catch (const std::exception& e) {
+      err << e.what() << "\n";
+      code = 1;
+    }
+  }
+  char code_buf[4];
+  PutU32(code_buf, static_cast<std::uint32_t>(code));
+  SendFrame(conn, 'x', code_buf, 4);
+}
+
+// Listens on a UNIX socket and runs scripts for clients on a pool of worker threads.
+// Compiled scripts and their parsed modules stay resident between requests; every request
+// runs with options (e.g. its step and time limits). Never returns unless the socket
+// cannot be set up.
+inline int Serve(const std::string& socket_path, const InterpreterOptions& options, std::ostream& err) {
+  sockaddr_un addr{};
+  if (socket_path.size() >= sizeof addr.sun_path) {
+    err << "Socket path too long: " << socket_path << "\n";
+    return 1;
+  }
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+  int listener = SocketCloexec(AF_UNIX, SOCK_STREAM);
+  if (listener < 0) {
+    err << "socket: " << std::strerror(errno) << "\n";
+    return 1;
+  }
+  struct stat st;
+  if (::lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) ::unlink(socket_path.c_str());
+  if (::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0 || ::listen(listener, 128) != 0) {
+    err << "Failed to listen on " << socket_path << ": " << std::strerror(errno) << "\n";
+    ::close(listener);
+    return 1;
+  }
+
+  ScriptCache cache(options);
+  auto worker = [&]() {
+    while (true) {
+      int conn = AcceptCloexec(listener);
+      if (conn < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        return;
+      }
+      ServeConnection(conn, cache);
+      ::close(conn);
+    }
+  };
+  std::vector<std::thread> workers;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 1; i < threads; i++) workers.emplace_back(worker);
+  worker();
+  for (auto& t : workers) t.join();
+  ::close(listener);
+  return 1;
+}
+
+// Sends a script path and input to a server started with Serve and relays its output.
+// input_path may be empty (no input) or "-" (standard input). Returns the script's exit code.
+inline int RunClient(const std::string& socket_path, const std::string& script_path, const std::string& input_path,
+                     std::ostream& err) {
+  char resolved[PATH_MAX];
+  if (!::realpath(script_path.c_str(), resolved)) {
+    err << "Failed to open file: " << script_path << "\n";
+    return 1;
+  }
+  int in_fd = -1;
+  if (input_path == "-") {
+    in_fd = STDIN_FILENO;
+  } else if (!input_path.empty()) {
+    in_fd = ::open(input_path.c_str(), O_RDONLY);
+    if (in_fd < 0) {
+      err << "Failed to open file: " << input_path << "\n";
+      return 1;
+    }
+  }
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, socket_path.c_str(), sizeof addr.sun_path - 1);
+  int conn = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (conn < 0 || ::connect(conn, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) {
+    err << "Failed to connect to " << socket_path << ": " << std::strerror(errno) << "\n";
+    if (conn >= 0) ::close(conn);
+    if (in_fd > STDIN_FILENO) ::close(in_fd);
+    return 1;
+  }
+
+  std::string path(resolved);
+  char len_buf[4];
+  PutU32(len_buf, static_cast<std::uint32_t>(path.size()));
+  SendAll(conn, len_buf, 4);
+  SendAll(conn, path.data(), path.size());
+
+  // Input is pumped on its own thread so a script that writes before it has read all of
+  // its input cannot deadlock against us. The wake pipe stops it once the script is done.
+  int wake[2];
+  if (::pipe(wake) != 0) {
+    err << "pipe: " << std::strerror(errno) << "\n";
+    ::close(conn);
+    if (in_fd > STDIN_FILENO) ::close(in_fd);
+    return 1;
+  }
+  std::thread pump([conn, in_fd, &wake]() {
+    if (in_fd >= 0) {
+      std::vector<char> buf(1 << 16);
+      pollfd fds[2] = {{in_fd, POLLIN, 0}, {wake[0], POLLIN, 0}};
+      while (true) {
+        if (::poll(fds, 2, -1) < 0) {
+          if (errno == EINTR) continue;
+          break;
+        }
+        if (fds[1].revents) break;
+        ssize_t n = ::read(in_fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || !SendAll(conn, buf.data(), static_cast<std::size_t>(n))) break;
+      }
+    }
+    ::shutdown(conn, SHUT_WR);
+  });
+
+  int code = 1;
+  std::vector<char> payload;
+  char header[5];
+  while (RecvAll(conn, header, sizeof header)) {
+    payload.resize(GetU32(header + 1));
+    if (!RecvAll(conn, payload.data(), payload.size())) break;
+    if (header[0] == 'x' && payload.size() == 4) {
+      code = static_cast<int>(GetU32(payload.data()));
+      break;
+    }
+    std::fwrite(payload.data(), 1, payload.size(), header[0] == 'e' ? stderr : stdout);
+  }
+  std::fflush(stdout);
+  // The server may finish without reading all input; unblock the pump before joining.
+  char wake_byte = 0;
+  WriteNoSigpipe(wake[1], &wake_byte, 1);
+  pump.join();
+  ::close(wake[0]);
+  ::close(wake[1]);
+  ::close(conn);
+  if (in_fd > STDIN_FILENO) ::close(in_fd);
+  return code;
 }
+#endif
 
 
 }  // namespace potatolang
@@ -0,0 +1,28 @@
+// aPpLegUo
+// The whole interpreter compiled once into libpotato_rt.a (see runtime/potato_rt.h).
+#include "potato_rt.h"
+#include "potatolang.h"
+#include <iostream>
+#include <string>
+
+namespace potatolang {
+
+int RunEmbeddedScript(const char* script, std::size_t size, int argc, char** argv) {
+  try {
+    InterpreterOptions options;
+    std::string inputPath;
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--unbuffered") options.unbuffered = true;
+      else if (inputPath.empty()) inputPath = arg;
+    }
+    if (!options.unbuffered) ConfigureStdout();
+    auto input = !inputPath.empty() ? InputSource::Open(inputPath) : InputSource::FromString("");
+    return RunScript(std::string(script, size), input, std::cout, std::cerr, options);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+}
+
+}  // namespace potatolang
@@ -0,0 +1,14 @@
+// aPpLegUo
+// Entry point of the prebuilt runtime library (libpotato_rt.a). Binaries produced by
+// `potatolang script.pt --out binary` consist of a generated main() that calls this with
+// the embedded script, linked against the library, so they never compile potatolang.h.
+#pragma once
+#include <cstddef>
+
+namespace potatolang {
+
+// Runs script with the same command line handling as `potatolang --run`: an optional
+// input file (or - for stdin) and --unbuffered. Returns the process exit code.
+int RunEmbeddedScript(const char* script, std::size_t size, int argc, char** argv);
+
+}  // namespace potatolang
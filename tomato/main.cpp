@@ -150,7 +150,7 @@ int main(int argc, char** argv) {
 
     // Keywords for highlighting
     std::unordered_set<std::string> keywords = {
-       "let", "print", "if", "else", "while", "fun", "return", "import",
+       "let", "print", "if", "else", "while", "fun", "return", "yield", "import",
        "true", "false", "nil", "and", "or"
     };
 
@@ -237,11 +237,12 @@ int main(int argc, char** argv) {
               // Since we'll build tomato in root, ./potatolang is correct
               std::string cmd = "./potatolang --run " + filename;
               std::string result;
-              std::array<char, 128> buffer;
+              std::vector<char> buffer(1 << 16);
               std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
               if (pipe) {
-                  while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-                      result += buffer.data();
+                  size_t n;
+                  while ((n = fread(buffer.data(), 1, buffer.size(), pipe.get())) > 0) {
+                      result.append(buffer.data(), n);
                   }
               }
               outputContent = result;
@@ -0,0 +1,50 @@
+// aPpLegUo
+// Build-time generator for potatos_embedded.inc: parses each standard library module and
+// writes its AST image (AstWriter format) as a constexpr byte table that potatolang.h
+// compiles in, so imports of these modules never touch the disk.
+// Usage: embed_modules <out.inc> <module.pt>...
+#include "potatolang.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: embed_modules <out.inc> <module.pt>...\n";
+    return 1;
+  }
+  std::ostringstream images, table;
+  for (int i = 2; i < argc; i++) {
+    std::string path = argv[i];
+    std::string name = path.substr(path.find_last_of("/\\") + 1);
+    if (name.size() > 3 && name.compare(name.size() - 3, 3, ".pt") == 0) name.resize(name.size() - 3);
+
+    std::vector<potatolang::StmtPtr> program;
+    std::ostringstream err;
+    if (!potatolang::CompileSource(potatolang::ReadFile(path), program, err)) {
+      std::cerr << path << ": " << err.str();
+      return 1;
+    }
+    std::string image;
+    potatolang::AstWriter(image).WriteStmts(program);
+
+    images << "static constexpr unsigned char kEmbeddedModule" << i - 2 << "[] = {";
+    for (std::size_t j = 0; j < image.size(); j++) {
+      images << (j % 24 == 0 ? "\n    " : " ") << static_cast<unsigned>(static_cast<unsigned char>(image[j])) << ",";
+    }
+    images << "\n};\n";
+    table << "    {\"" << potatolang::LiteralExpr::Escape(name) << "\", kEmbeddedModule" << i - 2 << ", sizeof(kEmbeddedModule"
+          << i - 2 << ")},\n";
+  }
+
+  std::ofstream out(argv[1], std::ios::binary | std::ios::trunc);
+  out << "// Generated by tools/embed_modules.cpp from the standard library modules. Do not edit.\n"
+      << images.str() << "static constexpr EmbeddedModuleImage kEmbeddedModules[] = {\n"
+      << table.str() << "    {nullptr, nullptr, 0},\n};\n";
+  if (!out.flush()) {
+    std::cerr << "Failed to write " << argv[1] << "\n";
+    return 1;
+  }
+  return 0;
+}